@@ -36,7 +36,57 @@ int setup(int core)
 	return 0;
 }
 
+/* We'd have to give back our core and provision another. */
+int pin_to_core(int core)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
 const char *os_name(void)
 {
 	return "Akaros";
 }
+
+int cpu_isolation(int core)
+{
+	return -1;
+}
+
+int cpu_smt_siblings(int a, int b)
+{
+	return -1;
+}
+
+int read_pkg_temp(void)
+{
+	return -1;
+}
+
+int read_energy(int core, uint64_t *pkg_uj, uint64_t *core_uj)
+{
+	return -1;
+}
+
+/* No ptrace on Akaros. */
+int xstate_child_spawn(void (*prep)(void))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void xstate_child_reap(int pid)
+{
+}
+
+int xstate_regset_get(int pid, void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int xstate_regset_set(int pid, void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
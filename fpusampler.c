@@ -0,0 +1,250 @@
+/* Copyright 2016-2017 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but without any warranty; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* fpusampler: an LD_PRELOAD library that samples which FP state components a
+ * real program has in use, so we know which of fputest's dirty tests matter.
+ *
+ *	LD_PRELOAD=./libfpusampler.so FPUSAMPLER_HZ=1000 ./service
+ *
+ * A SIGPROF timer interrupts whichever thread is on the CPU, and the kernel
+ * puts that thread's XSAVE area in the signal frame.  (We can't XGETBV(1) in the
+ * handler: the kernel gives handlers a fresh FPU.)  The frame's xstate_bv is
+ * XINUSE for AVX and up, but Linux always sets the x87 and SSE bits, so for
+ * those we look at the legacy region instead: they're in use unless they hold
+ * their init values.  Each sample bumps a per-thread count for that xstate_bv,
+ * and at exit we write the counts to FPUSAMPLER_OUT, by default
+ * fpusampler.<pid>.dat:
+ *
+ *	tid xstate_bv count
+ *
+ * fputest -t REPLAY reads these.  Linux only. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include "fpustate.h"
+
+#define SAMPLER_MAX_THREADS 512
+
+/* Threads get their counts on their first sample, one per possible xstate_bv
+ * of the components XCR0 enabled, so a process with a handful of threads and
+ * x87/SSE/AVX only costs a few pages. */
+static struct sampler_thread {
+	pid_t tid;
+	uint64_t *counts;
+} threads[SAMPLER_MAX_THREADS];
+
+static uint64_t sampled;		/* components we count, from XCR0 */
+static int nr_states;			/* 2 ^ popcount(sampled) */
+static uint64_t nr_dropped;		/* no thread slot, memory, or XSAVE area */
+static int sample_hz = 100;
+
+/* Packs the sampled bits of bv together, for indexing counts. */
+static int bv_to_idx(uint64_t bv)
+{
+	int idx = 0, n = 0;
+
+	for (int b = 0; b < 64; b++)
+		if (sampled & (1ULL << b))
+			idx |= ((bv >> b) & 1) << n++;
+	return idx;
+}
+
+static uint64_t idx_to_bv(int idx)
+{
+	uint64_t bv = 0;
+	int n = 0;
+
+	for (int b = 0; b < 64; b++)
+		if (sampled & (1ULL << b))
+			bv |= (uint64_t)((idx >> n++) & 1) << b;
+	return bv;
+}
+
+/* The x87 and SSE bits of XINUSE, from the legacy region's contents. */
+static uint64_t legacy_in_use(struct ancillary_state *as)
+{
+	const uint64_t *xmm = (const uint64_t *)&as->xmm0;
+	uint64_t bv = 0;
+
+	if (as->fp_head_64d.fcw != 0x37f || as->fp_head_64d.fsw ||
+	    as->fp_head_64d.ftw)
+		bv |= 0x1;
+	if (as->fp_head_64d.mxcsr != 0x1f80)
+		bv |= 0x2;
+	for (int i = 0; i < 16 * 2 && !(bv & 0x2); i++)
+		if (xmm[i])
+			bv |= 0x2;
+	return bv;
+}
+
+static struct sampler_thread *get_thread(pid_t tid)
+{
+	pid_t old;
+
+	/* Open addressing, and threads never give up their slots. */
+	for (int i = 0; i < SAMPLER_MAX_THREADS; i++) {
+		struct sampler_thread *st = &threads[(tid + i) % SAMPLER_MAX_THREADS];
+
+		old = __atomic_load_n(&st->tid, __ATOMIC_RELAXED);
+		if (old == tid)
+			return st;
+		if (old)
+			continue;
+		if (__atomic_compare_exchange_n(&st->tid, &old, tid, false,
+		                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return st;
+		if (old == tid)
+			return st;
+	}
+	return NULL;
+}
+
+/* Only async-signal-safe things in here. */
+static void sample(int sig, siginfo_t *info, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	struct ancillary_state *as = (struct ancillary_state *)uc->uc_mcontext.fpregs;
+	struct sampler_thread *st;
+	uint64_t *counts;
+	uint64_t bv;
+	int saved_errno = errno;
+
+	st = get_thread(syscall(SYS_gettid));
+	/* Only this thread touches its counts, and SIGPROF is blocked while we're
+	 * in here, so there's no race to set them up.  mmap() is safe here, unlike
+	 * malloc(). */
+	if (st && !st->counts) {
+		counts = mmap(NULL, nr_states * sizeof(uint64_t),
+		              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		              -1, 0);
+		if (counts != MAP_FAILED)
+			__atomic_store_n(&st->counts, counts, __ATOMIC_RELEASE);
+	}
+	/* The kernel's struct _fpx_sw_bytes goes in the legacy area's unused
+	 * bytes.  Its magic says the XSAVE header and extended region follow. */
+	if (!st || !st->counts || !as ||
+	    as->reserv3.stor[0] != FP_XSTATE_MAGIC1) {
+		__atomic_fetch_add(&nr_dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		bv = (as->xstate_bv & ~0x3ULL) | legacy_in_use(as);
+		__atomic_fetch_add(&st->counts[bv_to_idx(bv)], 1, __ATOMIC_RELAXED);
+	}
+	errno = saved_errno;
+}
+
+static void start_timer(void)
+{
+	struct itimerval it;
+
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / sample_hz;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL))
+		perror("fpusampler: setitimer");
+}
+
+/* The child of a fork starts over with its own counts and its own timer. */
+static void after_fork_child(void)
+{
+	for (int i = 0; i < SAMPLER_MAX_THREADS; i++)
+		if (threads[i].counts)
+			munmap(threads[i].counts, nr_states * sizeof(uint64_t));
+	memset(threads, 0, sizeof(threads));
+	nr_dropped = 0;
+	start_timer();
+}
+
+__attribute__((constructor))
+static void sampler_start(void)
+{
+	struct sigaction sa, old;
+	char *hz = getenv("FPUSAMPLER_HZ");
+	uint32_t ecx;
+
+	fpustate_cpuid(0x1, 0x0, NULL, NULL, &ecx, NULL);
+	if (!(ecx & (1 << 27))) {	/* OSXSAVE */
+		fprintf(stderr, "fpusampler: no XSAVE, not sampling\n");
+		return;
+	}
+	sampled = fpustate_rxcr0() & X86_MAX_XCR0;
+	nr_states = 1 << __builtin_popcountll(sampled);
+	if (hz && atoi(hz) > 0)
+		sample_hz = atoi(hz);
+	if (sample_hz > 1000000)
+		sample_hz = 1000000;
+	if (sigaction(SIGPROF, NULL, &old) == 0 && old.sa_handler != SIG_DFL &&
+	    old.sa_handler != SIG_IGN) {
+		fprintf(stderr, "fpusampler: SIGPROF is taken, not sampling\n");
+		return;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sample;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL)) {
+		perror("fpusampler: sigaction");
+		return;
+	}
+	pthread_atfork(NULL, NULL, after_fork_child);
+	start_timer();
+}
+
+__attribute__((destructor))
+static void sampler_dump(void)
+{
+	struct itimerval off = {{0, 0}, {0, 0}};
+	char name[64];
+	char *path = getenv("FPUSAMPLER_OUT");
+	FILE *f;
+	uint64_t total = 0;
+
+	setitimer(ITIMER_PROF, &off, NULL);
+	if (!path) {
+		snprintf(name, sizeof(name), "fpusampler.%d.dat", getpid());
+		path = name;
+	}
+	f = fopen(path, "w");
+	if (!f) {
+		perror("fpusampler: opening outfile");
+		return;
+	}
+	for (int i = 0; i < SAMPLER_MAX_THREADS; i++)
+		for (int j = 0; threads[i].counts && j < nr_states; j++)
+			total += threads[i].counts[j];
+	fprintf(f,
+	        "# fpusampler: pid %d, %d Hz, components %#llx, %llu samples, %llu dropped\n",
+	        getpid(), sample_hz, sampled, total, nr_dropped);
+	fprintf(f, "# columns: tid xstate_bv count\n");
+	for (int i = 0; i < SAMPLER_MAX_THREADS; i++) {
+		if (!threads[i].tid || !threads[i].counts)
+			continue;
+		for (int j = 0; j < nr_states; j++)
+			if (threads[i].counts[j])
+				fprintf(f, "%d 0x%03llx %llu\n", threads[i].tid,
+				        idx_to_bv(j), threads[i].counts[j]);
+	}
+	fclose(f);
+}
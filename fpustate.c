@@ -0,0 +1,286 @@
+/* Copyright 2016-2017 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but without any warranty; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* libfpustate: the save and restore paths of fputest, split out so a runtime
+ * can use whatever fputest found to be fastest.  See fpustate.h. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "fpustate.h"
+
+#define NR_CALIB_ITERS 64
+#define MAX_STRATEGIES 12
+
+static uint64_t features;
+static struct fpustate_strategy strategy = {FPUSTATE_XSAVE, 0, 0};
+static struct fpustate_strategy candidates[MAX_STRATEGIES];
+static int nr_candidates;
+static struct ancillary_state template_as;
+static struct fpustate calib_ctx[2];
+
+/* Unlike fputest, we don't use rdpmc here.  A runtime may not be allowed to,
+ * and we only need to rank the strategies, not report cycles. */
+static inline __attribute__((always_inline))
+uint64_t calib_ticks(void)
+{
+	_mm_lfence();
+	return __rdtsc();
+}
+
+void fpustate_ctx_init(struct fpustate *ctx)
+{
+	memset(&ctx->as, 0, sizeof(struct ancillary_state));
+	ctx->as.fp_head_64d.mxcsr = 0x1f80;
+	ctx->init = true;
+}
+
+void fpustate_save(struct fpustate *ctx)
+{
+	uint64_t rfbm = features;
+	uint64_t in_use;
+
+	if (strategy.flags & (FPUSTATE_XINUSE | FPUSTATE_SKIP_INIT)) {
+		in_use = fpustate_rxinuse() & features;
+		if (!in_use && (strategy.flags & FPUSTATE_SKIP_INIT)) {
+			ctx->init = true;
+			return;
+		}
+		if (strategy.flags & FPUSTATE_XINUSE)
+			rfbm = in_use;
+	}
+	ctx->init = false;
+	switch (strategy.insn) {
+	case FPUSTATE_XSAVE:
+		/* XSAVE leaves the xstate_bv bits outside of RFBM alone, and we
+		 * don't want to restore stale components later.  Nor does it write
+		 * xcomp_bv, which XSAVEC might have, if the strategy changed. */
+		ctx->as.xstate_bv &= rfbm;
+		ctx->as.xcomp_bv = 0;
+		__builtin_ia32_xsave64(&ctx->as, rfbm);
+		break;
+	case FPUSTATE_XSAVEOPT:
+		ctx->as.xstate_bv &= rfbm;
+		ctx->as.xcomp_bv = 0;
+		__builtin_ia32_xsaveopt64(&ctx->as, rfbm);
+		break;
+	case FPUSTATE_XSAVEC:
+		/* XSAVEC writes the entire header. */
+		__builtin_ia32_xsavec64(&ctx->as, rfbm);
+		break;
+	}
+}
+
+void fpustate_restore(struct fpustate *ctx)
+{
+	if (ctx->init) {
+		if ((strategy.flags & FPUSTATE_SKIP_INIT) && !(fpustate_rxinuse() & features))
+			return;
+		ctx->as.xstate_bv = 0;
+	}
+	__builtin_ia32_xrstor64(&ctx->as, features);
+}
+
+/* Returns -1 if the CPU can't do the strategy. */
+int fpustate_set_strategy(enum fpustate_insn insn, int flags)
+{
+	if ((insn == FPUSTATE_XSAVEOPT && !fpustate_cpu_has(CPUID_XSAVEOPT)) ||
+	    (insn == FPUSTATE_XSAVEC && !fpustate_cpu_has(CPUID_XSAVEC)) ||
+	    (flags && !fpustate_cpu_has(CPUID_XGETBV_XINUSE)))
+		return -1;
+	strategy.insn = insn;
+	strategy.flags = flags;
+	return 0;
+}
+
+void fpustate_get_strategy(struct fpustate_strategy *s)
+{
+	*s = strategy;
+}
+
+void fpustate_strategy_name(struct fpustate_strategy *s, char *buf,
+                            size_t len)
+{
+	static const char * const insn_names[] = {
+		[FPUSTATE_XSAVE] = "XSAVE",
+		[FPUSTATE_XSAVEOPT] = "XSAVEOPT",
+		[FPUSTATE_XSAVEC] = "XSAVEC",
+	};
+
+	snprintf(buf, len, "%s%s%s", insn_names[s->insn],
+	         s->flags & FPUSTATE_XINUSE ? "+XINUSE" : "",
+	         s->flags & FPUSTATE_SKIP_INIT ? "+SKIP_INIT" : "");
+}
+
+/* Gives the template something other than zeros to restore.  Any bit pattern
+ * is a valid x87/SSE/AVX register value. */
+static void setup_template(void)
+{
+	uint32_t avx_offset, avx_size;
+
+	memset(&template_as, 0, sizeof(struct ancillary_state));
+	template_as.fp_head_64d.mxcsr = 0x1f80;
+	memset(&template_as.st0_mm0, 0x5a, 8 * sizeof(__128bits));
+	memset(&template_as.xmm0, 0xa5, 16 * sizeof(__128bits));
+	fpustate_cpuid(0xd, 0x2, &avx_size, &avx_offset, NULL, NULL);
+	if ((features & 0x4) && avx_offset + avx_size <=
+	                        sizeof(struct ancillary_state))
+		memset((uint8_t *)&template_as + avx_offset, 0x3c, avx_size);
+	template_as.xstate_bv = features & 0x7;
+}
+
+int fpustate_cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Puts the FPU in the template's state, with only 'in_use' components in use,
+ * as if a thread had run and modified them. */
+static void run_calib_thread(uint64_t in_use)
+{
+	template_as.xstate_bv = in_use;
+	__builtin_ia32_xrstor64(&template_as, features);
+}
+
+/* Median cost of switching from a thread using 'out' to one using 'in', with
+ * the current strategy.  The incoming context was saved with fpustate_save(),
+ * the same as a runtime would, so a thread that was in its init state gets
+ * whatever the strategy does for those, e.g. SKIP_INIT's skipped restore.
+ * Like in fputest, the outgoing thread modifies its state after its restore, so
+ * we don't just measure the modified optimization. */
+static int64_t calibrate_switch(uint64_t out, uint64_t in)
+{
+	int64_t res[NR_CALIB_ITERS];
+	uint64_t start;
+
+	fpustate_ctx_init(&calib_ctx[0]);
+	for (int i = 0; i < NR_CALIB_ITERS; i++) {
+		run_calib_thread(in);
+		fpustate_save(&calib_ctx[1]);
+		fpustate_restore(&calib_ctx[0]);
+		run_calib_thread(out);
+		start = calib_ticks();
+		fpustate_save(&calib_ctx[0]);
+		fpustate_restore(&calib_ctx[1]);
+		res[i] = calib_ticks() - start;
+	}
+	qsort(res, NR_CALIB_ITERS, sizeof(int64_t), fpustate_cmp_s64);
+	return res[NR_CALIB_ITERS / 2];
+}
+
+static void add_candidate(enum fpustate_insn insn, int flags)
+{
+	/* Threads using nothing, only SSE, and everything, switching to each
+	 * other. */
+	uint64_t states[] = {0, features & 0x2, features & 0x7};
+	int nr_states = sizeof(states) / sizeof(states[0]);
+	struct fpustate_strategy *s = &candidates[nr_candidates++];
+
+	fpustate_set_strategy(insn, flags);
+	s->insn = insn;
+	s->flags = flags;
+	s->cost = 0;
+	for (int i = 0; i < nr_states; i++)
+		for (int j = 0; j < nr_states; j++)
+			s->cost += calibrate_switch(states[i], states[j]);
+}
+
+/* The components of 'xcr0' whose standard-format offset and size fit in
+ * struct ancillary_state.  PKRU, for one, starts right past its end. */
+static uint64_t fitting_features(uint64_t xcr0)
+{
+	uint32_t size, offset;
+
+	for (int i = 2; i < 64; i++) {
+		if (!(xcr0 & (1ULL << i)))
+			continue;
+		fpustate_cpuid(0xd, i, &size, &offset, NULL, NULL);
+		if (offset + size > sizeof(struct ancillary_state))
+			xcr0 &= ~(1ULL << i);
+	}
+	return xcr0;
+}
+
+/* Calibrates and picks a strategy for saving 'feat' (the XSAVE state-component
+ * bitmap), or everything we can if 'feat' is 0.  Returns -1 if the CPU can't do
+ * XSAVE. */
+int fpustate_init(uint64_t feat)
+{
+	uint32_t ecx;
+	enum fpustate_insn insns[3];
+	int nr_insns = 0;
+	bool xinuse;
+	struct fpustate_strategy *best;
+	static struct ancillary_state caller_as;
+
+	fpustate_cpuid(0x1, 0x0, NULL, NULL, &ecx, NULL);
+	if (!(ecx & (1 << 27)))		/* OSXSAVE */
+		return -1;
+	xinuse = fpustate_cpu_has(CPUID_XGETBV_XINUSE);
+	features = fitting_features(fpustate_rxcr0() & X86_MAX_XCR0);
+	if (feat)
+		features &= feat;
+	/* Calibration runs on our caller's FPU, so give it back afterwards.  No
+	 * stores to caller_as before this: the compiler would use an xmm for them.
+	 * Only XSAVE and XRSTOR touch it, so xcomp_bv stays 0, and XRSTOR ignores
+	 * xstate_bv bits outside of features. */
+	__builtin_ia32_xsave64(&caller_as, features);
+
+	insns[nr_insns++] = FPUSTATE_XSAVE;
+	if (fpustate_cpu_has(CPUID_XSAVEOPT))
+		insns[nr_insns++] = FPUSTATE_XSAVEOPT;
+	if (fpustate_cpu_has(CPUID_XSAVEC))
+		insns[nr_insns++] = FPUSTATE_XSAVEC;
+
+	setup_template();
+	nr_candidates = 0;
+	for (int i = 0; i < nr_insns; i++) {
+		add_candidate(insns[i], 0);
+		if (!xinuse)
+			continue;
+		add_candidate(insns[i], FPUSTATE_XINUSE);
+		add_candidate(insns[i], FPUSTATE_SKIP_INIT);
+		add_candidate(insns[i], FPUSTATE_XINUSE | FPUSTATE_SKIP_INIT);
+	}
+
+	best = &candidates[0];
+	for (int i = 1; i < nr_candidates; i++)
+		if (candidates[i].cost < best->cost)
+			best = &candidates[i];
+	strategy = *best;
+	__builtin_ia32_xrstor64(&caller_as, features);
+	return 0;
+}
+
+void fpustate_report(FILE *f)
+{
+	char name[64];
+
+	fprintf(f,
+	        "fpustate: features %#llx, calibrated TSC ticks over all switches:\n",
+	        features);
+	for (int i = 0; i < nr_candidates; i++) {
+		fpustate_strategy_name(&candidates[i], name, sizeof(name));
+		fprintf(f, "fpustate: %c %-28s %llu\n",
+		        candidates[i].insn == strategy.insn &&
+		        candidates[i].flags == strategy.flags ? '*' : ' ',
+		        name, candidates[i].cost);
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/* libfpustate: save/restore of a thread's FP state, for embedding in runtimes.
+ *
+ * Call fpustate_init() once.  It runs a short calibration (the same sort of
+ * restore-dirty-save cycles fputest measures) and picks whichever strategy is
+ * cheapest on this CPU.  After that, fpustate_save() and fpustate_restore()
+ * use that strategy.  fpustate_set_strategy() overrides the pick, but only
+ * after fpustate_init().  Contexts must be set up with fpustate_ctx_init()
+ * before their first restore.
+ *
+ * We only manage the components that fit in struct ancillary_state, so e.g.
+ * PKRU and AMX stay with the caller. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ancillary_state.h"
+
+static inline void fpustate_cpuid(uint32_t level1, uint32_t level2,
+                                  uint32_t *eaxp, uint32_t *ebxp,
+                                  uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	asm volatile("cpuid"
+	             : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+	             : "a"(level1), "c"(level2));
+	if (eaxp)
+		*eaxp = eax;
+	if (ebxp)
+		*ebxp = ebx;
+	if (ecxp)
+		*ecxp = ecx;
+	if (edxp)
+		*edxp = edx;
+}
+
+static inline uint64_t fpustate_rxcr0(void)
+{
+	uint32_t eax, edx;
+
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c" (0));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+/* XGETBV with ECX = 1 returns XCR0 & XINUSE: the components that are not in
+ * their init state.  Only use this if
+ * fpustate_cpu_has(CPUID_XGETBV_XINUSE). */
+static inline uint64_t fpustate_rxinuse(void)
+{
+	uint32_t eax, edx;
+
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c" (1));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+/* CPUID.(EAX=0DH,ECX=1):EAX */
+#define CPUID_XSAVEOPT		(1 << 0)
+#define CPUID_XSAVEC		(1 << 1)
+#define CPUID_XGETBV_XINUSE	(1 << 2)
+
+static inline bool fpustate_cpu_has(uint32_t feat)
+{
+	uint32_t eax;
+
+	fpustate_cpuid(0xd, 0x1, &eax, NULL, NULL, NULL);
+	return eax & feat;
+}
+
+enum fpustate_insn {
+	FPUSTATE_XSAVE,
+	FPUSTATE_XSAVEOPT,
+	FPUSTATE_XSAVEC,
+};
+
+/* Only save the components XINUSE says are in use. */
+#define FPUSTATE_XINUSE		(1 << 0)
+/* Skip the save entirely if nothing is in use, and skip the restore if both
+ * the saved and current states are in their init state.  This is only for init
+ * states: XINUSE can't tell us whether a thread modified its state since its
+ * last restore, only whether it has any, so we can't skip restores of
+ * unmodified state the way XSAVEOPT skips saves of it. */
+#define FPUSTATE_SKIP_INIT	(1 << 1)
+
+struct fpustate_strategy {
+	enum fpustate_insn insn;
+	int flags;
+	uint64_t cost;				/* calibrated TSC ticks, summed over switches */
+};
+
+struct fpustate {
+	bool init;					/* saved while in the init state */
+	struct ancillary_state as;
+};
+
+int fpustate_init(uint64_t features);
+int fpustate_set_strategy(enum fpustate_insn insn, int flags);
+void fpustate_get_strategy(struct fpustate_strategy *s);
+void fpustate_ctx_init(struct fpustate *ctx);
+void fpustate_save(struct fpustate *ctx);
+void fpustate_restore(struct fpustate *ctx);
+void fpustate_strategy_name(struct fpustate_strategy *s, char *buf,
+                            size_t len);
+void fpustate_report(FILE *f);
+
+/* A qsort() comparator for int64_t, which fputest shares. */
+int fpustate_cmp_s64(const void *a, const void *b);
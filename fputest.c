@@ -28,6 +28,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -36,15 +38,25 @@
 #include <x86intrin.h>
 #include <unistd.h>
 #include <sched.h>
+#include <poll.h>
+#include <pthread.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/wait.h>
 
 #include "fputest.h"
+#include "fpustate.h"
 
 static int nr_iters = 32;
-static uint64_t *save_res;
-static uint64_t rd_overhead;
+static int64_t *save_res;
+/* What we subtract from each measurement, and the 5th and 95th percentiles of
+ * the individual overhead samples, which is how uncertain we are about it. */
+static int64_t rd_overhead;
+static int64_t rd_overhead_p5, rd_overhead_p95;
+static uint64_t rd_overhead_when;
+static int recal_secs = 60;
 static FILE *outfile;
 static char *outfile_name = "raw.dat";
 static unsigned int family, model, stepping;
@@ -54,24 +66,6 @@ static struct ancillary_state alt_as;
 static struct ancillary_state init_as;
 static struct ancillary_state dirty_as;
 
-static inline void cpuid(uint32_t level1, uint32_t level2, uint32_t *eaxp,
-                         uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
-{
-	uint32_t eax, ebx, ecx, edx;
-
-	asm volatile("cpuid"
-	             : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
-	             : "a"(level1), "c"(level2));
-	if (eaxp)
-		*eaxp = eax;
-	if (ebxp)
-		*ebxp = ebx;
-	if (ecxp)
-		*ecxp = ecx;
-	if (edxp)
-		*edxp = edx;
-}
-
 static void set_vendor_4_bytes(unsigned char *str, uint32_t reg)
 {
 	for (int i = 0; i < sizeof(reg); i++)
@@ -83,13 +77,13 @@ static void set_cpuinfo(void)
 	uint32_t eax, ebx, ecx, edx;
 	unsigned int ext_family, ext_model;
 
-	cpuid(0x0, 0x0, NULL, &ebx, &ecx, &edx);
+	fpustate_cpuid(0x0, 0x0, NULL, &ebx, &ecx, &edx);
 	set_vendor_4_bytes(vendor + 0, ebx);
 	set_vendor_4_bytes(vendor + 4, edx);
 	set_vendor_4_bytes(vendor + 8, ecx);
 	vendor[12] = '\0';
 
-	cpuid(0x1, 0x0, &eax, NULL, NULL, NULL);
+	fpustate_cpuid(0x1, 0x0, &eax, NULL, NULL, NULL);
 	ext_family = (eax >> 20) & 0xff;
 	ext_model = (eax >> 16) & 0xf;
 	family = (eax >> 8) & 0xf;
@@ -107,25 +101,22 @@ uint64_t start_timing(void)
     return cycles();
 }
 
+/* Results can come out negative, when the overhead was a little more than
+ * usual.  We keep them: clamping would bias the cheapest cells upwards. */
 static inline __attribute__((always_inline))
-uint64_t stop_timing(uint64_t start)
+int64_t sub_overhead(uint64_t diff)
 {
-    uint64_t end, diff;
-
-	end = cycles();
-	diff = end - start;		/* unsigned, wraparound sorts itself out */
-    diff -= rd_overhead;
-	if ((int64_t) diff < 0)
-		return 1;
-	return diff;
+	return (int64_t)diff - rd_overhead;
 }
 
-static inline uint64_t rxcr0(void)
+static inline __attribute__((always_inline))
+int64_t stop_timing(uint64_t start)
 {
-	uint32_t eax, edx;
+    uint64_t end;
 
-	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c" (0));
-	return ((uint64_t)edx << 32) | eax;
+	end = cycles();
+	/* unsigned, wraparound sorts itself out */
+	return sub_overhead(end - start);
 }
 
 /* This gets passed to XSAVE via EDX:EAX.  Internally, it gets ANDed with xcr0.
@@ -137,6 +128,10 @@ static inline uint64_t rxcr0(void)
  */
 static unsigned long long mask = 0x7;
 
+/* Prepended to every result's test name, e.g. to tell apart the runs of a mask
+ * sweep in the same output file. */
+static char cell_prefix[32] = "";
+
 static char *mm0 = "|_MM:0_|";
 static char *mm1 = "|_MM:1_|";
 static char *mm2 = "|_MM:2_|";
@@ -260,6 +255,80 @@ static void dirty_hi_ymm_xmm_x87(void)
 	dirty_x87();
 }
 
+/* The rest change the legacy region in ways dirty_x87's MMX doesn't: real x87
+ * stack entries (which move TOP and tag only what's pushed), status flags, and
+ * control words.  MXCSR is part of the SSE component. */
+
+/* Empties the stack and clears the status word, so we start from the same
+ * place whatever ran before us (MMX leaves every tag valid, and pushing onto
+ * a full stack overflows).  FNINIT also resets FCW, which we keep. */
+static void clear_x87(void)
+{
+	uint16_t fcw;
+
+	asm volatile("fnstcw %0" : "=m"(fcw));
+	asm volatile("fninit");
+	asm volatile("fldcw %0" : : "m"(fcw));
+}
+
+static void push_x87(int n)
+{
+	clear_x87();
+	for (int i = 0; i < n; i++)
+		asm volatile("fldpi");
+}
+
+static void dirty_x87_stack_1(void)
+{
+	push_x87(1);
+}
+
+static void dirty_x87_stack_4(void)
+{
+	push_x87(4);
+}
+
+static void dirty_x87_stack_8(void)
+{
+	push_x87(8);
+}
+
+/* Divides by zero, takes a square root of -1, and a square root of pi, leaving
+ * ZE, IE, and PE set in the status word, and an empty stack.  They stay
+ * masked: an unmasked pending exception would fault at our next MMX
+ * instruction. */
+static void dirty_x87_flags(void)
+{
+	clear_x87();
+	asm volatile("fld1; fldz; fdivrp; fstp %st(0)");
+	asm volatile("fld1; fchs; fsqrt; fstp %st(0)");
+	asm volatile("fldpi; fsqrt; fstp %st(0)");
+}
+
+/* Round toward zero, 64-bit precision, all exceptions masked. */
+static void dirty_x87_fcw(void)
+{
+	uint16_t fcw = 0x0f7f;
+
+	asm volatile("fldcw %0" : : "m"(fcw));
+}
+
+/* FTZ and DAZ, like -ffast-math sets at startup. */
+static void dirty_mxcsr_daz_ftz(void)
+{
+	uint32_t mxcsr = 0x1f80 | 0x8040;
+
+	asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+}
+
+/* Round toward zero. */
+static void dirty_mxcsr_rz(void)
+{
+	uint32_t mxcsr = 0x1f80 | 0x6000;
+
+	asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+}
+
 static void noop(void)
 {
 }
@@ -278,24 +347,128 @@ static void full_dirty_as(struct ancillary_state *as)
 	memcpy(as, &dirty_as, sizeof(struct ancillary_state));
 }
 
+/* Sets up an initialized state that we can use for resets.  Importantly, this
+ * has the xstate_bv[] bits set to 0.  XRSTOR loads MXCSR even then, so it
+ * needs its default. */
+static void setup_init_as(void)
+{
+	memset(&init_as, 0, sizeof(struct ancillary_state));
+	init_as.fp_head_64d.fcw = 0x37f;
+	init_as.fp_head_64d.mxcsr = 0x1f80;
+}
+
+/* Whether every component in m fits in an ancillary_state, in the standard
+ * format.  PKRU and AMX don't, and saving them would overrun our areas. */
+static bool mask_fits(uint64_t m)
+{
+	uint32_t size, offset;
+
+	if (m & ~(uint64_t)X86_MAX_XCR0)
+		return false;
+	for (int i = 2; i < 64; i++) {
+		if (!(m & (1ULL << i)))
+			continue;
+		fpustate_cpuid(0xd, i, &size, &offset, NULL, NULL);
+		if (offset + size > sizeof(struct ancillary_state))
+			return false;
+	}
+	return true;
+}
+
 /* Sets the processor's FP state to an initialized, unmodified state. */
 static void reset_fp(void)
 {
 	__builtin_ia32_xrstor64(&init_as, mask);
 }
 
+/* Sorts vals in place, so only call this once you're done with the order. */
+static int64_t median(int64_t *vals, int n)
+{
+	qsort(vals, n, sizeof(int64_t), fpustate_cmp_s64);
+	return vals[n / 2];
+}
+
+/* If set, output_results() hands the results to this instead of writing them
+ * out.  Modes that summarize the samples themselves use this. */
+static void (*result_hook)(const char *title, const char *name);
+
+/* Writes the nr_iters results in save_res, one line per sample.  Keep 'name'
+ * at the same width as the dirty_test names for the R alignment.
+ *
+ * For cycles, we subtracted rd_overhead, but the real overhead of any one
+ * sample could be anywhere from its p5 to its p95.  The summary carries that
+ * through to the median, as a low and high estimate. */
+static void write_results(const char *title, const char *name, bool cycles)
+{
+	int64_t med;
+
+	for (int i = 0; i < nr_iters; i++)
+		fprintf(outfile, "%s%s %s %lld\n", cell_prefix, title, name,
+		        save_res[i]);
+	if (!cycles)
+		return;
+	med = median(save_res, nr_iters);
+	fprintf(outfile,
+	        "# summary: %s%s %s median %lld low %lld high %lld (overhead %lld, p5 %lld, p95 %lld)\n",
+	        cell_prefix, title, name, med,
+	        med - (rd_overhead_p95 - rd_overhead),
+	        med + (rd_overhead - rd_overhead_p5), rd_overhead, rd_overhead_p5,
+	        rd_overhead_p95);
+}
+
+/* For cycle counts that had rd_overhead subtracted. */
+static void output_results(const char *title, const char *name)
+{
+	if (result_hook)
+		result_hook(title, name);
+	else
+		write_results(title, name, true);
+}
+
+/* For everything else: bytes, energy, and cycles from long batches. */
+static void output_counts(const char *title, const char *name)
+{
+	if (result_hook)
+		result_hook(title, name);
+	else
+		write_results(title, name, false);
+}
+
+/* Goes to stderr and to the outfile, where it's an R comment. */
+static void report(const char *fmt, ...)
+{
+	static bool mid_line;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	/* Tables build their rows with several calls. */
+	if (!mid_line)
+		fprintf(outfile, "# ");
+	va_start(ap, fmt);
+	vfprintf(outfile, fmt, ap);
+	va_end(ap);
+	mid_line = fmt[0] && fmt[strlen(fmt) - 1] != '\n';
+}
+
 static uint64_t abs_diff(uint64_t x, uint64_t y)
 {
 	return x >= y ? x - y : y - x;
 }
 
-static uint64_t compute_rd_overhead(void)
+#define NR_LOOPS 10000
+#define NR_OVERHEAD_TRIES 10
+
+/* One try at measuring the overhead.  Returns the two estimates, and leaves
+ * the individual samples in 'samples', sorted. */
+static void measure_rd_overhead(int64_t *samples, uint64_t *opt1p,
+                                uint64_t *opt2p)
 {
 	uint64_t start;
 	uint64_t end;
 	uint64_t sum = 0;
 	uint64_t opt1, opt2;
-	#define NR_LOOPS 10000
 
 	/* There's a couple ways you can compute this.  The first way is the way
 	 * we'll use it: just two reads, and using the measurement of each iteration
@@ -303,6 +476,7 @@ static uint64_t compute_rd_overhead(void)
 	for (int i = 0; i < NR_LOOPS; i++) {
 		start = cycles();
 		end = cycles();
+		samples[i] = end - start;
 		sum += (end - start);
 	}
 	opt1 = sum / NR_LOOPS;
@@ -323,17 +497,58 @@ static uint64_t compute_rd_overhead(void)
 		for (int j = 0; j < JMAX; j++)
 			asm volatile("movq %%rax, %0;" : : "m"(foo[j]));
 	 */
-	/* 2 seems reasonable for rdpmc. */
-	if (abs_diff(opt1, opt2) > 2) {
+	qsort(samples, NR_LOOPS, sizeof(int64_t), fpustate_cmp_s64);
+	*opt1p = opt1;
+	*opt2p = opt2;
+}
+
+/* Sets rd_overhead and its spread.  If the two estimates disagree, we probably
+ * got interfered with, so we try again a few times, and if that doesn't help,
+ * we go with the try where they were closest. */
+static void compute_rd_overhead(void)
+{
+	static int64_t samples[NR_LOOPS];
+	uint64_t opt1, opt2, diff;
+	uint64_t best_diff = UINT64_MAX;
+
+	for (int i = 0; i < NR_OVERHEAD_TRIES; i++) {
+		measure_rd_overhead(samples, &opt1, &opt2);
+		diff = abs_diff(opt1, opt2);
+		if (diff < best_diff) {
+			best_diff = diff;
+			rd_overhead_p5 = samples[NR_LOOPS * 5 / 100];
+			rd_overhead_p95 = samples[NR_LOOPS * 95 / 100];
+			/* The estimates aren't from the samples, and can land outside
+			 * their p5-p95, which would turn the summaries' bounds inside
+			 * out. */
+			rd_overhead = MIN(MAX((int64_t)MIN(opt1, opt2), rd_overhead_p5),
+			                  rd_overhead_p95);
+		}
+		/* 2 seems reasonable for rdpmc. */
+		if (diff <= 2)
+			break;
 		fprintf(stderr,
-		        "Overhead diff between %llu %llu is too great (interference?), try again!\n",
+		        "Overhead diff between %llu %llu is too great (interference?), trying again\n",
 		        opt1, opt2);
-		exit(-1);
+		usleep(10000);
 	}
+	if (best_diff > 2)
+		fprintf(stderr,
+		        "Overhead never settled down, using the closest try (diff %llu)\n",
+		        best_diff);
+	rd_overhead_when = time(NULL);
 	fprintf(stderr,
-	        "Measurement overhead is %llu, subtracted from the results\n",
-	        MIN(opt1, opt2));
-	return MIN(opt1, opt2);
+	        "Measurement overhead is %lld (p5 %lld, p95 %lld), subtracted from the results\n",
+	        rd_overhead, rd_overhead_p5, rd_overhead_p95);
+}
+
+/* Long runs can drift (frequency, interference), so we redo the overhead every
+ * recal_secs, between cells. */
+static void maybe_recalibrate(void)
+{
+	if (recal_secs <= 0 || time(NULL) - rd_overhead_when < recal_secs)
+		return;
+	compute_rd_overhead();
 }
 
 /* Keep the names at the same width for easy R alignment.  clobbered_xstatebv is
@@ -354,6 +569,13 @@ struct dirty_test {
 	{".....hi_ymm_x87", 0x7, dirty_hi_ymm_x87},
 	{"...all_data_reg", 0x7, dirty_all_data_reg},
 	{".hi_ymm_xmm_x87", 0x7, dirty_hi_ymm_xmm_x87},
+	{"....x87_stack_1", 0x1, dirty_x87_stack_1},
+	{"....x87_stack_4", 0x1, dirty_x87_stack_4},
+	{"....x87_stack_8", 0x1, dirty_x87_stack_8},
+	{"......x87_flags", 0x1, dirty_x87_flags},
+	{"........x87_fcw", 0x1, dirty_x87_fcw},
+	{"..mxcsr_daz_ftz", 0x2, dirty_mxcsr_daz_ftz},
+	{".......mxcsr_rz", 0x2, dirty_mxcsr_rz},
 };
 
 /* Measures the costs of xsave / xsaveopt during a restore-dirty-save cycle.
@@ -372,6 +594,7 @@ struct dirty_test {
 static void test_xsave(struct dirty_test *dt, bool opt, bool clean)
 {
 	uint64_t start;
+	char title[32];
 
 	for (int i = 0; i < nr_iters; i++) {
 		if (clean)
@@ -388,9 +611,9 @@ static void test_xsave(struct dirty_test *dt, bool opt, bool clean)
 		save_res[i] = stop_timing(start);
 	}
 
-	for (int i = 0; i < nr_iters; i++)
-		fprintf(outfile, "%sXSAVE%s %s %llu\n",
-		        clean ? "CLEAN_" : "", opt ? "OPT" : "", dt->name, save_res[i]);
+	snprintf(title, sizeof(title), "%sXSAVE%s", clean ? "CLEAN_" : "",
+	         opt ? "OPT" : "");
+	output_results(title, dt->name);
 }
 
 enum {
@@ -413,7 +636,8 @@ enum {
 static void test_xrstor(struct dirty_test *dt, int cmd)
 {
 	uint64_t start;
-	char *title = NULL;
+	char *cmd_name = NULL;
+	char title[32];
 
 	reset_fp();
 	dt->dirty();
@@ -435,17 +659,17 @@ static void test_xrstor(struct dirty_test *dt, int cmd)
 
 	switch (cmd) {
 	case XRSTOR_CMD_CLEAN:
-		title = "CLEAN";
+		cmd_name = "CLEAN";
 		break;
 	case XRSTOR_CMD_DIRTY:
-		title = "DIRTY";
+		cmd_name = "DIRTY";
 		break;
 	case XRSTOR_CMD_NOOP:
-		title = "NOOP_";
+		cmd_name = "NOOP_";
 		break;
 	}
-	for (int i = 0; i < nr_iters; i++)
-		fprintf(outfile, "%s_XRSTOR %s %llu\n", title, dt->name, save_res[i]);
+	snprintf(title, sizeof(title), "%s_XRSTOR", cmd_name);
+	output_results(title, dt->name);
 }
 
 /* Measures XRSTOR speed for restoring a context when the *current FPU* has been
@@ -471,6 +695,7 @@ static void test_xrstor(struct dirty_test *dt, int cmd)
 static void test_xrstor_alt(struct dirty_test *dt, bool clean, bool presave)
 {
 	uint64_t start;
+	char title[32];
 
 	if (clean)
 		reset_fp();
@@ -487,9 +712,9 @@ static void test_xrstor_alt(struct dirty_test *dt, bool clean, bool presave)
 		save_res[i] = stop_timing(start);
 	}
 
-	for (int i = 0; i < nr_iters; i++)
-		fprintf(outfile, "%s_%sXRSTOR %s %llu\n", clean ? "CLEAN" : "DIRTY",
-		        presave ? "PRESAVE" : "", dt->name, save_res[i]);
+	snprintf(title, sizeof(title), "%s_%sXRSTOR", clean ? "CLEAN" : "DIRTY",
+	         presave ? "PRESAVE" : "");
+	output_results(title, dt->name);
 }
 
 /* Tests whether XSAVE does the init optimization: omit saving components in
@@ -503,6 +728,7 @@ static void test_xrstor_alt(struct dirty_test *dt, bool clean, bool presave)
 static void test_init_xsave(struct dirty_test *dt, bool opt)
 {
 	uint64_t start;
+	char title[32];
 
 	for (int i = 0; i < nr_iters; i++) {
 		/* This also does an rstor, but it is from a different address than
@@ -518,168 +744,2647 @@ static void test_init_xsave(struct dirty_test *dt, bool opt)
 		save_res[i] = stop_timing(start);
 	}
 
-	for (int i = 0; i < nr_iters; i++)
-		fprintf(outfile, "INIT_XSAVE%s %s %llu\n", opt ? "OPT" : "",
-		        dt->name, save_res[i]);
+	snprintf(title, sizeof(title), "INIT_XSAVE%s", opt ? "OPT" : "");
+	output_results(title, dt->name);
 }
 
-enum {
-	XSAVE,
-	XRSTOR,
-	XRSTOR_ALT,
-	INIT_XSAVE,
-};
+/* Compares the two ways of not saving the components outside of 'sub': asking
+ * XSAVE not to (the requested-feature bitmap), versus leaving them in their
+ * init state and letting XSAVEOPT's init optimization skip them.
+ *
+ * For MASKED, everything is in use and we only ask for 'sub'.  For INITOPT, we
+ * ask for everything in 'full', but only 'sub' is in use.  In both cases, we
+ * save to a different address than we restored from, so the modified
+ * optimization won't kick in. */
+static void test_mask_cost(unsigned long long sub, unsigned long long full,
+                           bool initopt, int64_t *med)
+{
+	uint64_t start;
+	char name[32];
 
-static const char * const main_tests[] = {
-	[XSAVE] = "XSAVE",
-	[XRSTOR] = "XRSTOR",
-	[XRSTOR_ALT] = "XRSTOR_ALT",
-	[INIT_XSAVE] = "INIT_XSAVE",
-};
+	for (int i = 0; i < nr_iters; i++) {
+		if (initopt) {
+			__builtin_ia32_xrstor64(&init_as, full);
+			__builtin_ia32_xrstor64(&dirty_as, sub);
+			start = start_timing();
+			__builtin_ia32_xsaveopt64(&alt_as, full);
+		} else {
+			__builtin_ia32_xrstor64(&dirty_as, full);
+			start = start_timing();
+			__builtin_ia32_xsaveopt64(&alt_as, sub);
+		}
+		save_res[i] = stop_timing(start);
+	}
 
-static int get_test_id(const char *name)
-{
-	for (int i = 0; i < sizeof(main_tests) / sizeof(main_tests[0]); i++)
-		if (!strcmp(main_tests[i], name))
-			return i;
-	return -1;
+	snprintf(name, sizeof(name), ".....mask_0x%03llx", sub);
+	output_results(initopt ? "INITOPT_XSAVEOPT" : "MASKED_XSAVEOPT", name);
+	*med = median(save_res, nr_iters);
 }
 
-/* Given an initially clean FPU on the processor, xsave should only save the
- * parts we think dirty() touched.  We can see those in xstatebv. */
-static void assert_clobbers(void)
+/* Measures libfpustate's save and restore, with whatever strategy it picked.
+ *
+ * The other tests use the XSAVE instructions directly, not through the
+ * library.  Each of them pins down one instruction, mask, and save area, and
+ * the library's strategy and branches would be part of what they measure.
+ *
+ * This is the same restore-dirty-save cycle as test_xsave(), with the thread
+ * restoring from and saving to its own context.  For the restore, we restore a
+ * context that was saved with dt's dirtiness, with dt's dirtiness on the FPU. */
+static void test_fpustate(struct dirty_test *dt, bool restore)
 {
-	struct dirty_test *dt;
+	static struct fpustate ctx, other;
+	uint64_t start;
 
-	for (int i = 0; i < sizeof(dirty_tests) / sizeof(dirty_tests[0]); i++) {
-		dt = &dirty_tests[i];
-		reset_fp();
+	fpustate_ctx_init(&other);
+	reset_fp();
+	dt->dirty();
+	fpustate_save(&other);
+
+	for (int i = 0; i < nr_iters; i++) {
+		fpustate_ctx_init(&ctx);
+		fpustate_restore(&ctx);
 		dt->dirty();
-		__builtin_ia32_xsaveopt64(&as, 0x7);
-		if (as.xstate_bv != dt->clobbered_xstatebv) {
-			fprintf(stderr,
-					"Test %s had unexpected clobbers: xstate_bv was %p, expected %p\n",
-					dt->name, as.xstate_bv, dt->clobbered_xstatebv);
-			exit(-1);
+		if (restore) {
+			start = start_timing();
+			fpustate_restore(&other);
+		} else {
+			start = start_timing();
+			fpustate_save(&ctx);
 		}
+		save_res[i] = stop_timing(start);
 	}
+
+	output_results(restore ? "FPUSTATE_RSTOR" : "FPUSTATE_SAVE", dt->name);
 }
 
-int main(int argc, char *argv[])
+static bool have_pkru(void)
 {
-	int i;
-	int core = 0;
-	int opt = 0;
-	static struct option long_options[] = {
-	    {"samples", required_argument, 0, 's'},
-	    {"savemask", required_argument, 0, 'm'},
-	    {"core", required_argument, 0, 'c'},
-	    {"outfile", required_argument, 0, 'o'},
-	    {"test", required_argument, 0, 't'},
-	    {0, 0, 0, 0}};
-	int long_index = 0;
-	time_t now;
-	int test_id = XSAVE;
+	uint32_t ecx;
 
-	while ((opt = getopt_long(argc, argv, "c:s:m:o:t:", long_options,
-	                          &long_index)) != -1) {
-		switch (opt) {
-		case 'c':
-			core = strtol(optarg, 0, 0);
-			break;
-		case 'm':
-			mask = strtol(optarg, 0, 0);
-			break;
-		case 's':
-			nr_iters = atoi(optarg);
-			break;
-		case 'o':
-			outfile_name = optarg;
-			break;
-		case 't':
-			test_id = get_test_id(optarg);
-			if (test_id < 0) {
-				fprintf(stderr, "Unknown test '%s'.  Try:\n", optarg);
-				for (int i = 0;
-				     i < sizeof(main_tests) / sizeof(main_tests[0]);
-				     i++) {
-					fprintf(stderr, "\t%s\n", main_tests[i]);
-				}
-				exit(1);
-			}
-			break;
-		default:
-			fprintf(stderr, "Usage: %s [-m savemask] [-s numsamples]\n",
-			        argv[0]);
-			exit(1);
+	fpustate_cpuid(0x7, 0x0, NULL, NULL, &ecx, NULL);
+	return ecx & (1 << 4);		/* OSPKE */
+}
+
+static uint32_t rd_pkru(void)
+{
+	uint32_t eax, edx;
+
+	asm volatile("rdpkru" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+}
+
+static void wr_pkru(uint32_t pkru)
+{
+	asm volatile("wrpkru" : : "a"(pkru), "c"(0), "d"(0));
+}
+
+static void check_fpustate_fail(const char *what, const char *name)
+{
+	fprintf(stderr, "fpustate: %s lost %s\n", what, name);
+	exit(-1);
+}
+
+/* Round-trips a known xmm0 through fpustate_init() and every strategy, and
+ * makes sure PKRU, which the library doesn't manage, is left alone.  Leaves
+ * the library with the strategy it picked. */
+static void check_fpustate(uint64_t features)
+{
+	static struct fpustate ctx;
+	struct fpustate_strategy picked, s;
+	__128bits xmm, want;
+	uint32_t pkru = 0, want_pkru = 0x55555554;
+	bool pkeys = have_pkru();
+	char name[64];
+
+	memset(&want, 0x6b, sizeof(want));
+	if (pkeys) {
+		pkru = rd_pkru();
+		wr_pkru(want_pkru);
+	}
+	asm volatile("movdqu %0, %%xmm0" : : "m"(want) : "xmm0");
+	if (fpustate_init(features) < 0) {
+		fprintf(stderr, "fpustate: no XSAVE support\n");
+		exit(-1);
+	}
+	asm volatile("movdqu %%xmm0, %0" : "=m"(xmm));
+	if (memcmp(&xmm, &want, sizeof(xmm)))
+		check_fpustate_fail("fpustate_init", "xmm0");
+	if (pkeys && rd_pkru() != want_pkru)
+		check_fpustate_fail("fpustate_init", "PKRU");
+
+	fpustate_get_strategy(&picked);
+	for (int insn = FPUSTATE_XSAVE; insn <= FPUSTATE_XSAVEC; insn++) {
+		for (int flags = 0; flags <= (FPUSTATE_XINUSE | FPUSTATE_SKIP_INIT);
+		     flags++) {
+			if (fpustate_set_strategy(insn, flags) < 0)
+				continue;
+			s.insn = insn;
+			s.flags = flags;
+			fpustate_strategy_name(&s, name, sizeof(name));
+			fpustate_ctx_init(&ctx);
+			asm volatile("movdqu %0, %%xmm0" : : "m"(want) : "xmm0");
+			fpustate_save(&ctx);
+			asm volatile("pxor %%xmm0, %%xmm0" : : : "xmm0");
+			fpustate_restore(&ctx);
+			asm volatile("movdqu %%xmm0, %0" : "=m"(xmm));
+			if (memcmp(&xmm, &want, sizeof(xmm)))
+				check_fpustate_fail(name, "xmm0");
+			if (pkeys && rd_pkru() != want_pkru)
+				check_fpustate_fail(name, "PKRU");
 		}
 	}
-	assert((mask & rxcr0()) == mask);
+	fpustate_set_strategy(picked.insn, picked.flags);
+	if (pkeys)
+		wr_pkru(pkru);
+}
 
-	if (setup(core) < 0) {
-		perror("setup");
-		exit(1);
-	}
-	enable_speed_step(core, 0);
-	save_res = malloc(nr_iters * sizeof(uint64_t));
-	set_cpuinfo();
-	rd_overhead = compute_rd_overhead();
+static int nr_children = 16;
+static struct dirty_test *child_dt;
 
-	outfile = fopen(outfile_name, "w");
-	if (!outfile) {
-		perror("opening outfile");
+static void child_prep(void)
+{
+	reset_fp();
+	child_dt->dirty();
+}
+
+/* Measures what a debugger or checkpointer pays to read and write a stopped
+ * thread's FP state: PTRACE_GETREGSET / SETREGSET of NT_X86_XSTATE, from a
+ * child that stopped right after dirtying its FPU with dt.
+ *
+ * The single-call numbers use one child.  The batch numbers go over
+ * nr_children stopped children, one call each, and report the average per
+ * call, which is what a checkpoint of a multi-threaded process would see.
+ *
+ * Note the counter includes the kernel's cycles (if it counts ring 0), which is
+ * what we want here: most of the work is the kernel converting its xstate
+ * buffer to the user ABI format. */
+static void test_ptrace(struct dirty_test *dt, bool batch)
+{
+	uint64_t start;
+	int pids[nr_children];
+	int nr_pids = batch ? nr_children : 1;
+	uint32_t xsave_size;
+	void *buf;
+	int len, ret = 0;
+	char title[32];
+
+	/* Max size of the XSAVE area for all components the CPU supports. */
+	fpustate_cpuid(0xd, 0x0, NULL, NULL, &xsave_size, NULL);
+	xsave_size = MAX(xsave_size, sizeof(struct ancillary_state));
+	if (posix_memalign(&buf, 64, roundup(xsave_size, 64))) {
+		perror("posix_memalign");
 		exit(-1);
 	}
-	fprintf(stderr, "Outputting to %s\n", outfile_name);
+	child_dt = dt;
+	for (int i = 0; i < nr_pids; i++) {
+		pids[i] = xstate_child_spawn(child_prep);
+		if (pids[i] < 0) {
+			perror("xstate_child_spawn");
+			exit(-1);
+		}
+	}
+	len = xstate_regset_get(pids[0], buf, xsave_size);
+	if (len < 0) {
+		perror("PTRACE_GETREGSET");
+		exit(-1);
+	}
+	if (!batch)
+		fprintf(stderr, "%s: NT_X86_XSTATE is %d bytes, xstate_bv %#llx\n",
+		        dt->name, len, ((struct ancillary_state *)buf)->xstate_bv);
+
+	for (int set = 0; set < 2; set++) {
+		for (int i = 0; i < nr_iters; i++) {
+			start = start_timing();
+			for (int j = 0; j < nr_pids && ret >= 0; j++) {
+				if (set)
+					ret = xstate_regset_set(pids[j], buf, len);
+				else
+					ret = xstate_regset_get(pids[j], buf, xsave_size);
+			}
+			save_res[i] = stop_timing(start) / nr_pids;
+			/* A failed call is fast, not a sample. */
+			if (ret < 0) {
+				perror(set ? "PTRACE_SETREGSET" : "PTRACE_GETREGSET");
+				for (int j = 0; j < nr_pids; j++)
+					xstate_child_reap(pids[j]);
+				exit(-1);
+			}
+		}
+		snprintf(title, sizeof(title), "%sPTRACE_%sREGSET",
+		         batch ? "BATCH_" : "", set ? "SET" : "GET");
+		output_results(title, dt->name);
+	}
 
-	fprintf(outfile, "# title: %s %s Costs\n", os_name(), main_tests[test_id]);
-	fprintf(outfile, "# machine: %s %d, %d, %d (F, M, S)\n", vendor, family,
-	        model, stepping);
-	now = time(NULL);
-	fprintf(outfile, "# date: %s\n", ctime(&now));
+	for (int i = 0; i < nr_pids; i++)
+		xstate_child_reap(pids[i]);
+	free(buf);
+}
 
-	/* Set up an initialized state that we can use for resets.  Importantly,
-	 * this has the xstate_bv[] bits set to 0. */
-	memset(&init_as, 0, sizeof(struct ancillary_state));
-	init_as.fp_head_64d.mxcsr = 0x1f80;
+#define NR_DIRTY_TESTS (sizeof(dirty_tests) / sizeof(dirty_tests[0]))
 
-	/* Set up a fully-dirty ancillary state. */
-	dirty_all_data_reg();
-	__builtin_ia32_xsaveopt64(&dirty_as, 7);
+/* Right-justifies str in buf, padded with dots like the dirty_test names. */
+static void pad_name(char *buf, size_t len, const char *str)
+{
+	int pad = 15 - (int)strlen(str);
 
-	assert_clobbers();
+	snprintf(buf, len, "%.*s%s", MAX(pad, 0), "...............", str);
+}
 
-	/* Prime it.  (not sure if this is necessary or not) */
-	reset_fp();
-	__builtin_ia32_xsaveopt64(&as, mask);
-	__builtin_ia32_xsave64(&as, mask);
-	__builtin_ia32_xrstor64(&as, mask);
+/* The catalog for test_libc(): common routines that may or may not leave some
+ * of the FPU in use behind them.  'n' is the size of the input in bytes.  The
+ * ones that don't take a buffer do one call or element per 16 bytes. */
+#define LIBC_MAX_SIZE 65536
+static char libc_src[LIBC_MAX_SIZE + 1] __attribute__((aligned(64)));
+static char libc_dst[LIBC_MAX_SIZE + 1] __attribute__((aligned(64)));
+static float libc_fa[LIBC_MAX_SIZE / 4], libc_fb[LIBC_MAX_SIZE / 4];
+static volatile uintptr_t libc_sink;
+static volatile double libc_dsink;
+
+static void libc_memcpy(size_t n)
+{
+	memcpy(libc_dst, libc_src, n);
+}
 
-	for (i = 0; i < sizeof(dirty_tests) / sizeof(dirty_tests[0]); i++) {
-		switch (test_id) {
-		case XSAVE:
-			test_xsave(&dirty_tests[i], false, false);
-			test_xsave(&dirty_tests[i], true,  false);
-			test_xsave(&dirty_tests[i], false, true);
-			test_xsave(&dirty_tests[i], true,  true);
-			break;
-		case XRSTOR:
-			test_xrstor(&dirty_tests[i], XRSTOR_CMD_NOOP);
-			test_xrstor(&dirty_tests[i], XRSTOR_CMD_CLEAN);
-			test_xrstor(&dirty_tests[i], XRSTOR_CMD_DIRTY);
-			break;
-		case XRSTOR_ALT:
-			test_xrstor_alt(&dirty_tests[i], false, false);
-			test_xrstor_alt(&dirty_tests[i], true,  false);
-			test_xrstor_alt(&dirty_tests[i], false, true);
-			test_xrstor_alt(&dirty_tests[i], true,  true);
-			break;
-		case INIT_XSAVE:
-			test_init_xsave(&dirty_tests[i], false);
-			test_init_xsave(&dirty_tests[i], true);
-			break;
-		}
-	}
+static void libc_memmove(size_t n)
+{
+	memmove(libc_dst + 1, libc_dst, n - 1);
+}
+
+static void libc_memset(size_t n)
+{
+	memset(libc_dst, 0x5a, n);
+}
+
+static void libc_memcmp(size_t n)
+{
+	libc_sink = memcmp(libc_dst, libc_src, n);
+}
+
+static void libc_memchr(size_t n)
+{
+	libc_sink = (uintptr_t)memchr(libc_src, '\0', n);
+}
+
+/* libc_src is a string of n - 1 'a's, see test_libc(). */
+static void libc_strlen(size_t n)
+{
+	libc_sink = strlen(libc_src);
+}
+
+static void libc_strchr(size_t n)
+{
+	libc_sink = (uintptr_t)strchr(libc_src, 'b');
+}
+
+static void libc_strcpy(size_t n)
+{
+	strcpy(libc_dst, libc_src);
+}
+
+static void libc_snprintf(size_t n)
+{
+	char buf[64];
+
+	for (size_t i = 0; i < n / 16; i++)
+		snprintf(buf, sizeof(buf), "%f", i * 1.5);
+	libc_sink = buf[0];
+}
+
+static void libc_strtod(size_t n)
+{
+	for (size_t i = 0; i < n / 16; i++)
+		libc_dsink = strtod("3.14159", NULL);
+}
+
+static void libc_exp(size_t n)
+{
+	for (size_t i = 0; i < n / 16; i++)
+		libc_dsink = exp(libc_dsink * 1e-9 + i);
+}
+
+static void libc_sin(size_t n)
+{
+	for (size_t i = 0; i < n / 16; i++)
+		libc_dsink = sin(libc_dsink * 1e-9 + i);
+}
+
+/* A loop the compiler vectorizes on its own, at least with -Ofast.  The first
+ * one gets the build's baseline ISA (SSE), the second is what you'd get from
+ * -march on anything with AVX2. */
+static void autovec_dot(size_t n)
+{
+	float sum = 0;
+
+	for (size_t i = 0; i < n / 4; i++)
+		sum += libc_fa[i] * libc_fb[i];
+	libc_dsink = sum;
+}
+
+__attribute__((target("avx2")))
+static void autovec_dot_avx2(size_t n)
+{
+	float sum = 0;
+
+	for (size_t i = 0; i < n / 4; i++)
+		sum += libc_fa[i] * libc_fb[i];
+	libc_dsink = sum;
+}
+
+static void libc_none(size_t n)
+{
+}
+
+static struct libc_routine {
+	char *name;
+	void (*call)(size_t n);
+} libc_routines[] = {
+	{"none", libc_none},
+	{"memcpy", libc_memcpy},
+	{"memmove", libc_memmove},
+	{"memset", libc_memset},
+	{"memcmp", libc_memcmp},
+	{"memchr", libc_memchr},
+	{"strlen", libc_strlen},
+	{"strchr", libc_strchr},
+	{"strcpy", libc_strcpy},
+	{"snprintf", libc_snprintf},
+	{"strtod", libc_strtod},
+	{"exp", libc_exp},
+	{"sin", libc_sin},
+	{"autovec", autovec_dot},
+	{"autovec2", autovec_dot_avx2},
+};
+
+static const size_t libc_sizes[] = {16, 256, 4096, LIBC_MAX_SIZE};
+
+/* Finds out which components a routine leaves in use, starting from an
+ * initialized FPU, and what that costs the next save.  Anything it leaves in
+ * use defeats the init optimization that test_init_xsave() measures.
+ *
+ * We report XINUSE right after the call (if the CPU has XGETBV 1), and the
+ * xstate_bv XSAVE wrote.  The saves are like test_init_xsave(). */
+static void test_libc(struct libc_routine *lr, size_t n, bool opt,
+                      uint64_t *xinuse, uint64_t *xstate_bv, int64_t *med)
+{
+	uint64_t start;
+	char name[32], buf[32];
+
+	memset(libc_src, 'a', n - 1);
+	libc_src[n - 1] = '\0';
+
+	reset_fp();
+	lr->call(n);
+	*xinuse = fpustate_cpu_has(CPUID_XGETBV_XINUSE) ? fpustate_rxinuse() & mask : -1;
+	__builtin_ia32_xsave64(&alt_as, mask);
+	*xstate_bv = alt_as.xstate_bv;
+
+	for (int i = 0; i < nr_iters; i++) {
+		reset_fp();
+		lr->call(n);
+		start = start_timing();
+		if (opt)
+			__builtin_ia32_xsaveopt64(&alt_as, mask);
+		else
+			__builtin_ia32_xsave64(&alt_as, mask);
+		save_res[i] = stop_timing(start);
+	}
+
+	snprintf(buf, sizeof(buf), "%s_%zu", lr->name, n);
+	pad_name(name, sizeof(name), buf);
+	output_results(opt ? "LIBC_XSAVEOPT" : "LIBC_XSAVE", name);
+	*med = median(save_res, nr_iters);
+}
+
+/* Runs the whole catalog and reports what each routine left dirty. */
+static void run_libc(void)
+{
+	struct libc_routine *lr;
+	uint64_t xinuse, xstate_bv;
+	int64_t med, opt_med, base_opt_med = 0;
+
+	for (int i = 0; i < LIBC_MAX_SIZE / 4; i++) {
+		libc_fa[i] = i * 0.5f;
+		libc_fb[i] = i * 0.25f;
+	}
+	report("Components left in use by libc and compiled code, from an initialized FPU:\n");
+	report("%-10s %6s %8s %10s %8s %10s %8s\n", "routine", "size", "XINUSE",
+	       "xstate_bv", "XSAVE", "XSAVEOPT", "vs none");
+	for (int i = 0; i < sizeof(libc_routines) / sizeof(libc_routines[0]); i++) {
+		lr = &libc_routines[i];
+		for (int j = 0; j < sizeof(libc_sizes) / sizeof(libc_sizes[0]); j++) {
+			maybe_recalibrate();
+			test_libc(lr, libc_sizes[j], false, &xinuse, &xstate_bv, &med);
+			test_libc(lr, libc_sizes[j], true, &xinuse, &xstate_bv, &opt_med);
+			if (!i && !j)
+				base_opt_med = opt_med;
+			report("%-10s %6zu %8llx %10llx %8lld %10lld %+8lld\n", lr->name,
+			       libc_sizes[j], xinuse, xstate_bv, med, opt_med,
+			       opt_med - base_opt_med);
+		}
+	}
+}
+
+/* Medians of test_swap(), [outgoing][incoming]. */
+static int64_t swap_matrix[NR_DIRTY_TESTS][NR_DIRTY_TESTS];
+
+/* Measures a whole context switch: XSAVEOPT of the outgoing context
+ * immediately followed by XRSTOR of the incoming one, each with its own
+ * dirtiness.  This is the dirty_test * dirty_test version of test_xsave() and
+ * test_xrstor().
+ *
+ * The outgoing thread restored from its own context, starting from init, and
+ * then dirtied it with 'out', so XSAVEOPT gets to use both optimizations like
+ * it would in a real switch.  The incoming image was saved with 'in' dirtiness
+ * to a separate address. */
+static void test_swap(struct dirty_test *out, struct dirty_test *in)
+{
+	uint64_t start;
+	char title[32];
+	const char *in_name = in->name;
+
+	reset_fp();
+	in->dirty();
+	__builtin_ia32_xsaveopt64(&alt_as, mask);
+
+	for (int i = 0; i < nr_iters; i++) {
+		initialize_as(&as);
+		__builtin_ia32_xrstor64(&as, mask);
+		out->dirty();
+		start = start_timing();
+		__builtin_ia32_xsaveopt64(&as, mask);
+		__builtin_ia32_xrstor64(&alt_as, mask);
+		save_res[i] = stop_timing(start);
+	}
+
+	while (*in_name == '.')
+		in_name++;
+	snprintf(title, sizeof(title), "SWAP_TO_%s", in_name);
+	output_results(title, out->name);
+	swap_matrix[out - dirty_tests][in - dirty_tests] = median(save_res,
+	                                                          nr_iters);
+}
+
+/* Byte classes for test_written(): the state components are their own bit
+ * numbers, then these. */
+#define WR_NR_COMPS 10
+#define WR_HEADER WR_NR_COMPS
+#define WR_OTHER (WR_NR_COMPS + 1)
+#define WR_NR_CLASSES (WR_NR_COMPS + 2)
+
+enum {
+	WR_XSAVE,
+	WR_XSAVEOPT,
+	WR_XSAVEOPT_MOD,
+	WR_XSAVEC,
+};
+
+static const char * const written_titles[] = {
+	[WR_XSAVE] = "BYTES_XSAVE",
+	[WR_XSAVEOPT] = "BYTES_XSAVEOPT",
+	[WR_XSAVEOPT_MOD] = "BYTES_XSAVEOPT_MOD",
+	[WR_XSAVEC] = "BYTES_XSAVEC",
+};
+
+static bool dump_written;
+
+/* No FPU or vector registers, unlike memset, so we don't disturb the state
+ * we're about to save. */
+static inline __attribute__((always_inline))
+void fill_canary(void *p, uint8_t canary, size_t len)
+{
+	asm volatile("rep stosb" : "+D"(p), "+c"(len) : "a"(canary) : "memory");
+}
+
+/* Sets class[i] to the class of byte i of an XSAVE area in the standard or
+ * compacted format, for the components in 'rfbm'. */
+static void classify_xsave_area(uint8_t *class, uint64_t rfbm, bool compacted)
+{
+	uint32_t size, offset, ecx;
+	uint32_t next = 576;
+
+	memset(class, WR_OTHER, sizeof(struct ancillary_state));
+	/* The legacy region: MXCSR and MXCSR_MASK belong to SSE. */
+	memset(class, 0, 160);
+	memset(class + 24, 1, 8);
+	memset(class + 160, 1, 256);
+	memset(class + 512, WR_HEADER, 64);
+	for (int i = 2; i < WR_NR_COMPS; i++) {
+		if (!(rfbm & (1ULL << i)))
+			continue;
+		fpustate_cpuid(0xd, i, &size, &offset, &ecx, NULL);
+		if (compacted) {
+			if (ecx & 0x2)
+				next = roundup(next, 64);
+			offset = next;
+			next += size;
+		}
+		if (offset + size > sizeof(struct ancillary_state))
+			continue;
+		memset(class + offset, i, size);
+	}
+}
+
+/* Does one save into alt_as, filled with 'canary' beforehand. */
+static void written_save(struct dirty_test *dt, int variant, uint8_t canary)
+{
+	if (variant == WR_XSAVEOPT_MOD) {
+		full_dirty_as(&alt_as);
+		__builtin_ia32_xrstor64(&alt_as, mask);
+	} else {
+		reset_fp();
+	}
+	dt->dirty();
+	fill_canary(&alt_as, canary, sizeof(struct ancillary_state));
+	switch (variant) {
+	case WR_XSAVE:
+		__builtin_ia32_xsave64(&alt_as, mask);
+		break;
+	case WR_XSAVEOPT:
+	case WR_XSAVEOPT_MOD:
+		__builtin_ia32_xsaveopt64(&alt_as, mask);
+		break;
+	case WR_XSAVEC:
+		__builtin_ia32_xsavec64(&alt_as, mask);
+		break;
+	}
+}
+
+/* Measures how many bytes of the save area each flavor of save actually
+ * writes, per component, which is the memory traffic of a switch.  We fill the
+ * area with a canary, save, and see what changed.  A saved byte could happen to
+ * equal the canary, so we do it twice with different canaries.
+ *
+ * XSAVE and XSAVEOPT save the same way as test_init_xsave(), so XSAVEOPT can
+ * use the init optimization.  XSAVEOPT_MOD saves to where we just restored
+ * from, like test_xsave(), so it can also use the modified optimization.
+ *
+ * The results are bytes, not cycles, and the per-component breakdown of the
+ * last sample goes into the report. */
+static void test_written(struct dirty_test *dt, int variant,
+                         uint64_t counts[WR_NR_CLASSES], int *lines)
+{
+	static struct ancillary_state first;
+	static uint8_t class[sizeof(struct ancillary_state)];
+	uint8_t *area = (uint8_t *)&alt_as;
+	uint8_t *first_area = (uint8_t *)&first;
+	const __m128i c1 = _mm_set1_epi8(0xa5), c2 = _mm_set1_epi8(0x5a);
+	__m128i v1, v2;
+	unsigned int changed;
+	uint64_t line_mask = 0;
+	char banner[64];
+
+	classify_xsave_area(class, mask, variant == WR_XSAVEC);
+	for (int i = 0; i < nr_iters; i++) {
+		written_save(dt, variant, 0xa5);
+		memcpy(&first, &alt_as, sizeof(struct ancillary_state));
+		written_save(dt, variant, 0x5a);
+
+		memset(counts, 0, WR_NR_CLASSES * sizeof(uint64_t));
+		line_mask = 0;
+		for (int off = 0; off < sizeof(struct ancillary_state); off += 16) {
+			v1 = _mm_load_si128((__m128i *)(first_area + off));
+			v2 = _mm_load_si128((__m128i *)(area + off));
+			changed = ~_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v1, c1),
+			                                           _mm_cmpeq_epi8(v2, c2)));
+			changed &= 0xffff;
+			if (!changed)
+				continue;
+			line_mask |= 1ULL << (off / 64);
+			for (int j = 0; j < 16; j++)
+				if (changed & (1 << j))
+					counts[class[off + j]]++;
+		}
+		save_res[i] = 0;
+		for (int j = 0; j < WR_NR_CLASSES; j++)
+			save_res[i] += counts[j];
+	}
+	*lines = __builtin_popcountll(line_mask);
+
+	if (dump_written) {
+		snprintf(banner, sizeof(banner), "%s %s", written_titles[variant],
+		         dt->name);
+		for (int l = 0; l < sizeof(struct ancillary_state) / 64; l++)
+			if (line_mask & (1ULL << l))
+				fpu_hexdump(banner, area + l * 64, 64);
+	}
+	output_counts(written_titles[variant], dt->name);
+}
+
+static void run_written(void)
+{
+	uint64_t counts[WR_NR_CLASSES];
+	int lines;
+	int last = fpustate_cpu_has(CPUID_XSAVEC) ? WR_XSAVEC : WR_XSAVEOPT_MOD;
+
+	/* Cache line bitmap is a uint64_t. */
+	assert(sizeof(struct ancillary_state) <= 64 * 64);
+	report("Bytes written per save, by component, mask %#llx:\n", mask);
+	report("%-18s %15s %5s %5s %5s %5s %5s %5s %6s %5s\n", "save", "dirty",
+	       "x87", "SSE", "AVX", "ext", "hdr", "other", "total", "lines");
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		maybe_recalibrate();
+		for (int v = WR_XSAVE; v <= last; v++) {
+			uint64_t ext = 0, total = 0;
+
+			test_written(&dirty_tests[i], v, counts, &lines);
+			for (int j = 3; j < WR_NR_COMPS; j++)
+				ext += counts[j];
+			for (int j = 0; j < WR_NR_CLASSES; j++)
+				total += counts[j];
+			report("%-18s %15s %5llu %5llu %5llu %5llu %5llu %5llu %6llu %5d\n",
+			       written_titles[v] + 6, dirty_tests[i].name, counts[0],
+			       counts[1], counts[2], ext, counts[WR_HEADER],
+			       counts[WR_OTHER], total, lines);
+		}
+	}
+}
+
+enum {
+	SC_GETPID,
+	SC_POLL,
+	SC_YIELD,
+	SC_YIELD_CONTENDED,
+	SC_NR,
+};
+
+static const char * const syscall_titles[] = {
+	[SC_GETPID] = "SYSCALL_GETPID",
+	[SC_POLL] = "SYSCALL_POLL",
+	[SC_YIELD] = "SYSCALL_YIELD",
+	[SC_YIELD_CONTENDED] = "SYSCALL_YIELD_CONTENDED",
+};
+
+static volatile bool yield_stop;
+
+/* Shares our core and uses its own FPU state, so every time we yield to it, the
+ * kernel has to reload ours on the way back out. */
+static void *yield_competitor(void *arg)
+{
+	while (!yield_stop) {
+		dirty_all_data_reg();
+		sched_yield();
+	}
+	return NULL;
+}
+
+/* Measures cheap syscalls with the FPU dirtied by dt.  Newer Linux kernels
+ * defer restoring the FPU until the return to userspace, so a syscall that
+ * switched to someone else pays for an XRSTOR of however much we had in use.
+ * The difference between dt and noop for a given syscall is the FP part.
+ *
+ * For the contended yield, a competing thread on our core (we inherit our
+ * affinity) runs between our yields. */
+static void test_syscall(struct dirty_test *dt, int sc, int64_t *med)
+{
+	uint64_t start;
+	pthread_t competitor;
+
+	if (sc == SC_YIELD_CONTENDED) {
+		yield_stop = false;
+		if (pthread_create(&competitor, NULL, yield_competitor, NULL)) {
+			perror("pthread_create");
+			exit(-1);
+		}
+		/* Let it get going. */
+		for (int i = 0; i < 100; i++)
+			sched_yield();
+	}
+
+	for (int i = 0; i < nr_iters; i++) {
+		reset_fp();
+		dt->dirty();
+		start = start_timing();
+		switch (sc) {
+		case SC_GETPID:
+			getpid();
+			break;
+		case SC_POLL:
+			poll(NULL, 0, 0);
+			break;
+		case SC_YIELD:
+		case SC_YIELD_CONTENDED:
+			sched_yield();
+			break;
+		}
+		save_res[i] = stop_timing(start);
+	}
+
+	if (sc == SC_YIELD_CONTENDED) {
+		yield_stop = true;
+		pthread_join(competitor, NULL);
+	}
+	output_results(syscall_titles[sc], dt->name);
+	*med = median(save_res, nr_iters);
+}
+
+static void run_syscall(void)
+{
+	int64_t meds[NR_DIRTY_TESTS][SC_NR];
+
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		maybe_recalibrate();
+		for (int sc = 0; sc < SC_NR; sc++)
+			test_syscall(&dirty_tests[i], sc, &meds[i][sc]);
+	}
+
+	report("Median syscall cycles by dirty state (delta vs noop):\n");
+	report("%15s", "");
+	for (int sc = 0; sc < SC_NR; sc++)
+		report(" %24s", syscall_titles[sc] + 8);
+	report("\n");
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		report("%15s", dirty_tests[i].name);
+		for (int sc = 0; sc < SC_NR; sc++)
+			report(" %12lld (%+9lld)", meds[i][sc], meds[i][sc] - meds[0][sc]);
+		report("\n");
+	}
+}
+
+enum {
+	COLD_EXEC,
+	COLD_PAGE,
+	COLD_MIGRATE,
+	COLD_IDLE,
+	COLD_NR,
+};
+
+static const char * const cold_names[] = {
+	[COLD_EXEC] = "EXEC",
+	[COLD_PAGE] = "PAGE",
+	[COLD_MIGRATE] = "MIGRATE",
+	[COLD_IDLE] = "IDLE",
+};
+
+static int cold_iters = 8;
+static int cold_sleep_ms = 100;
+static int cold_core = -1;
+
+/* The first cold_iters save/restore pairs on 'area', with dt's dirtiness.
+ * res gets the XSAVEOPT and XRSTOR of each iteration, interleaved. */
+static void cold_run(struct dirty_test *dt, struct ancillary_state *area,
+                     int64_t *res)
+{
+	uint64_t start;
+
+	for (int i = 0; i < cold_iters; i++) {
+		dt->dirty();
+		start = start_timing();
+		__builtin_ia32_xsaveopt64(area, mask);
+		res[2 * i] = stop_timing(start);
+		start = start_timing();
+		__builtin_ia32_xrstor64(area, mask);
+		res[2 * i + 1] = stop_timing(start);
+	}
+}
+
+/* The far side of COLD_EXEC: we were just exec'd, so do our cold_run() before
+ * anything else, and send the results back up the pipe.  We haven't computed
+ * the overhead, so these are raw, and our parent subtracts its overhead. */
+static void cold_exec_child(int fd, int core, struct dirty_test *dt)
+{
+	static struct ancillary_state area;
+	int64_t res[2 * cold_iters];
+
+	if (pin_to_core(core) < 0)
+		exit(-1);
+	/* main() didn't get this far, and dt may reset_fp(). */
+	setup_init_as();
+	cold_run(dt, &area, res);
+	if (write(fd, res, sizeof(res)) != sizeof(res))
+		exit(-1);
+	exit(0);
+}
+
+static char *self_path;
+
+static int cold_exec(int core, struct dirty_test *dt, int64_t *res)
+{
+	int fds[2], devnull, status;
+	pid_t pid;
+	char fd_str[16], core_str[16], mask_str[32], iters_str[16];
+	const char *dt_name = dt->name;
+	size_t len = 2 * cold_iters * sizeof(int64_t);
+	ssize_t ret;
+
+	while (*dt_name == '.')
+		dt_name++;
+	if (pipe(fds) < 0)
+		return -1;
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		close(fds[0]);
+		/* setup() is chatty, and we'd hear from every child. */
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, 2);
+		snprintf(fd_str, sizeof(fd_str), "%d", fds[1]);
+		snprintf(core_str, sizeof(core_str), "%d", core);
+		snprintf(mask_str, sizeof(mask_str), "%#llx", mask);
+		snprintf(iters_str, sizeof(iters_str), "%d", cold_iters);
+		execl(self_path, self_path, "-c", core_str, "-m", mask_str, "-d",
+		      dt_name, "--cold-iters", iters_str, "--cold-exec", fd_str,
+		      NULL);
+		_exit(-1);
+	}
+	close(fds[1]);
+	status = 0;
+	for (size_t got = 0; got < len; got += ret) {
+		ret = read(fds[0], (char *)res + got, len - got);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			status = -1;
+			break;
+		}
+	}
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	for (int i = 0; i < 2 * cold_iters; i++)
+		res[i] = sub_overhead(res[i]);
+	return status;
+}
+
+/* Measures the first cold_iters save/restore pairs after something made them
+ * cold, with each iteration reported as its own series, e.g. iter_00 is the
+ * coldest.  Everything else in fputest is warm: we prime it and then take
+ * nr_iters samples in a row.  There are nr_iters rounds per case:
+ *
+ * EXEC: right after exec, in a fresh process (with a fresh save area).
+ * PAGE: right after the save area's page was faulted in, with the first write.
+ * MIGRATE: right after moving to another core (cold_core).  We bounce back and
+ * forth, so every round is a migration.
+ * IDLE: right after sleeping for cold_sleep_ms. */
+static void run_cold(int core, struct dirty_test *dt)
+{
+	static struct ancillary_state area;
+	int64_t *res[COLD_NR];
+	int64_t *r, meds[2 * cold_iters];
+	struct ancillary_state *page;
+	size_t page_sz = roundup(sizeof(struct ancillary_state), 4096);
+	bool have_case[COLD_NR] = {true, true, true, true};
+	char title[32], buf[32], name[32];
+	int here = core;
+
+	if (cold_core < 0)
+		cold_core = (core + 1) % sysconf(_SC_NPROCESSORS_ONLN);
+	if (cold_core == core) {
+		report("COLD: cold core is core %d too (one CPU?), skipping MIGRATE\n",
+		       core);
+		have_case[COLD_MIGRATE] = false;
+	}
+	for (int c = 0; c < COLD_NR; c++)
+		res[c] = malloc(nr_iters * 2 * cold_iters * sizeof(int64_t));
+
+	for (int i = 0; i < nr_iters; i++) {
+		maybe_recalibrate();
+		r = res[COLD_EXEC] + i * 2 * cold_iters;
+		if (have_case[COLD_EXEC] && cold_exec(core, dt, r) < 0) {
+			fprintf(stderr, "COLD: exec of %s failed, skipping EXEC\n",
+			        self_path);
+			have_case[COLD_EXEC] = false;
+		}
+
+		r = res[COLD_PAGE] + i * 2 * cold_iters;
+		page = mmap(NULL, page_sz, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (page == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+		*(volatile uint64_t *)&page->xstate_bv = 0;
+		reset_fp();
+		cold_run(dt, page, r);
+		munmap(page, page_sz);
+
+		r = res[COLD_MIGRATE] + i * 2 * cold_iters;
+		if (have_case[COLD_MIGRATE]) {
+			here = here == core ? cold_core : core;
+			if (pin_to_core(here) < 0) {
+				fprintf(stderr, "COLD: can't move to core %d, skipping MIGRATE\n",
+				        here);
+				have_case[COLD_MIGRATE] = false;
+			} else {
+				reset_fp();
+				cold_run(dt, &area, r);
+			}
+		}
+
+		r = res[COLD_IDLE] + i * 2 * cold_iters;
+		reset_fp();
+		usleep(cold_sleep_ms * 1000);
+		cold_run(dt, &area, r);
+	}
+	pin_to_core(core);
+
+	report("Median cycles of the first %d iterations after each case, %s:\n",
+	       cold_iters, dt->name);
+	for (int c = 0; c < COLD_NR; c++) {
+		if (!have_case[c])
+			continue;
+		for (int op = 0; op < 2; op++) {
+			snprintf(title, sizeof(title), "COLD_%s_%s", cold_names[c],
+			         op ? "XRSTOR" : "XSAVEOPT");
+			for (int j = 0; j < cold_iters; j++) {
+				for (int i = 0; i < nr_iters; i++)
+					save_res[i] = res[c][i * 2 * cold_iters + 2 * j + op];
+				snprintf(buf, sizeof(buf), "iter_%02d", j);
+				pad_name(name, sizeof(name), buf);
+				output_results(title, name);
+				meds[j] = median(save_res, nr_iters);
+			}
+			report("%-22s", title);
+			for (int j = 0; j < cold_iters; j++)
+				report(" %6lld", meds[j]);
+			report("\n");
+		}
+	}
+	for (int c = 0; c < COLD_NR; c++)
+		free(res[c]);
+}
+
+/* What a runtime that doesn't use XSAVE at all might do: spill and fill the
+ * vector registers and MXCSR by hand.  Each register gets 32 bytes, even for
+ * the xmm versions, so the layout is the same. */
+struct spill_area {
+	uint8_t vec[16 * 32];
+	uint32_t mxcsr;
+} __attribute__((aligned(64)));
+
+static inline __attribute__((always_inline))
+void spill_xmm(struct spill_area *sa)
+{
+	asm volatile("movdqa %%xmm0, 0(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm1, 32(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm2, 64(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm3, 96(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm4, 128(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm5, 160(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm6, 192(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm7, 224(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm8, 256(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm9, 288(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm10, 320(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm11, 352(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm12, 384(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm13, 416(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm14, 448(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("movdqa %%xmm15, 480(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("stmxcsr %0" : "=m"(sa->mxcsr));
+}
+
+static inline __attribute__((always_inline))
+void fill_xmm(struct spill_area *sa)
+{
+	asm volatile("movdqa 0(%0), %%xmm0" : : "r"(sa->vec) : "%xmm0");
+	asm volatile("movdqa 32(%0), %%xmm1" : : "r"(sa->vec) : "%xmm1");
+	asm volatile("movdqa 64(%0), %%xmm2" : : "r"(sa->vec) : "%xmm2");
+	asm volatile("movdqa 96(%0), %%xmm3" : : "r"(sa->vec) : "%xmm3");
+	asm volatile("movdqa 128(%0), %%xmm4" : : "r"(sa->vec) : "%xmm4");
+	asm volatile("movdqa 160(%0), %%xmm5" : : "r"(sa->vec) : "%xmm5");
+	asm volatile("movdqa 192(%0), %%xmm6" : : "r"(sa->vec) : "%xmm6");
+	asm volatile("movdqa 224(%0), %%xmm7" : : "r"(sa->vec) : "%xmm7");
+	asm volatile("movdqa 256(%0), %%xmm8" : : "r"(sa->vec) : "%xmm8");
+	asm volatile("movdqa 288(%0), %%xmm9" : : "r"(sa->vec) : "%xmm9");
+	asm volatile("movdqa 320(%0), %%xmm10" : : "r"(sa->vec) : "%xmm10");
+	asm volatile("movdqa 352(%0), %%xmm11" : : "r"(sa->vec) : "%xmm11");
+	asm volatile("movdqa 384(%0), %%xmm12" : : "r"(sa->vec) : "%xmm12");
+	asm volatile("movdqa 416(%0), %%xmm13" : : "r"(sa->vec) : "%xmm13");
+	asm volatile("movdqa 448(%0), %%xmm14" : : "r"(sa->vec) : "%xmm14");
+	asm volatile("movdqa 480(%0), %%xmm15" : : "r"(sa->vec) : "%xmm15");
+	asm volatile("ldmxcsr %0" : : "m"(sa->mxcsr));
+}
+
+static inline __attribute__((always_inline))
+void spill_ymm(struct spill_area *sa)
+{
+	asm volatile("vmovdqa %%ymm0, 0(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm1, 32(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm2, 64(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm3, 96(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm4, 128(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm5, 160(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm6, 192(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm7, 224(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm8, 256(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm9, 288(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm10, 320(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm11, 352(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm12, 384(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm13, 416(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm14, 448(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vmovdqa %%ymm15, 480(%0)" : : "r"(sa->vec) : "memory");
+	asm volatile("vstmxcsr %0" : "=m"(sa->mxcsr));
+}
+
+static inline __attribute__((always_inline))
+void fill_ymm(struct spill_area *sa)
+{
+	asm volatile("vmovdqa 0(%0), %%ymm0" : : "r"(sa->vec) : "%xmm0");
+	asm volatile("vmovdqa 32(%0), %%ymm1" : : "r"(sa->vec) : "%xmm1");
+	asm volatile("vmovdqa 64(%0), %%ymm2" : : "r"(sa->vec) : "%xmm2");
+	asm volatile("vmovdqa 96(%0), %%ymm3" : : "r"(sa->vec) : "%xmm3");
+	asm volatile("vmovdqa 128(%0), %%ymm4" : : "r"(sa->vec) : "%xmm4");
+	asm volatile("vmovdqa 160(%0), %%ymm5" : : "r"(sa->vec) : "%xmm5");
+	asm volatile("vmovdqa 192(%0), %%ymm6" : : "r"(sa->vec) : "%xmm6");
+	asm volatile("vmovdqa 224(%0), %%ymm7" : : "r"(sa->vec) : "%xmm7");
+	asm volatile("vmovdqa 256(%0), %%ymm8" : : "r"(sa->vec) : "%xmm8");
+	asm volatile("vmovdqa 288(%0), %%ymm9" : : "r"(sa->vec) : "%xmm9");
+	asm volatile("vmovdqa 320(%0), %%ymm10" : : "r"(sa->vec) : "%xmm10");
+	asm volatile("vmovdqa 352(%0), %%ymm11" : : "r"(sa->vec) : "%xmm11");
+	asm volatile("vmovdqa 384(%0), %%ymm12" : : "r"(sa->vec) : "%xmm12");
+	asm volatile("vmovdqa 416(%0), %%ymm13" : : "r"(sa->vec) : "%xmm13");
+	asm volatile("vmovdqa 448(%0), %%ymm14" : : "r"(sa->vec) : "%xmm14");
+	asm volatile("vmovdqa 480(%0), %%ymm15" : : "r"(sa->vec) : "%xmm15");
+	asm volatile("vldmxcsr %0" : : "m"(sa->mxcsr));
+}
+
+enum {
+	LEGACY_FXSAVE,
+	LEGACY_FNSAVE,
+	LEGACY_SPILL_XMM,
+	LEGACY_SPILL_YMM,
+};
+
+static const char * const legacy_titles[][2] = {
+	[LEGACY_FXSAVE] = {"FXSAVE", "FXRSTOR"},
+	[LEGACY_FNSAVE] = {"FNSAVE", "FRSTOR"},
+	[LEGACY_SPILL_XMM] = {"SPILL_XMM", "FILL_XMM"},
+	[LEGACY_SPILL_YMM] = {"SPILL_YMM", "FILL_YMM"},
+};
+
+/* The non-XSAVE ways to save and restore: FXSAVE / FXRSTOR (x87 and SSE),
+ * FNSAVE / FRSTOR (x87 only, and FNSAVE reinitializes the FPU), and spilling
+ * the vector registers by hand.  None of these know anything about what is in
+ * use or modified, so they're the baseline the XSAVE optimizations compete
+ * with.
+ *
+ * The saves are measured like test_init_xsave(): from an initialized FPU that
+ * dt dirtied, to a different address than we restored from.  The restores are
+ * measured like the CLEAN case of test_xrstor(): an image saved with dt's
+ * dirtiness, restored onto an initialized FPU. */
+static void test_legacy(struct dirty_test *dt, int method, bool restore)
+{
+	static uint8_t fnsave_area[108] __attribute__((aligned(16)));
+	static struct spill_area sa;
+	uint64_t start;
+
+	if (restore) {
+		reset_fp();
+		dt->dirty();
+		switch (method) {
+		case LEGACY_FXSAVE:
+			__builtin_ia32_fxsave64(&as);
+			break;
+		case LEGACY_FNSAVE:
+			asm volatile("fnsave %0" : "=m"(fnsave_area));
+			break;
+		case LEGACY_SPILL_XMM:
+			spill_xmm(&sa);
+			break;
+		case LEGACY_SPILL_YMM:
+			spill_ymm(&sa);
+			break;
+		}
+	}
+
+	for (int i = 0; i < nr_iters; i++) {
+		reset_fp();
+		if (!restore)
+			dt->dirty();
+		start = start_timing();
+		switch (method) {
+		case LEGACY_FXSAVE:
+			if (restore)
+				__builtin_ia32_fxrstor64(&as);
+			else
+				__builtin_ia32_fxsave64(&alt_as);
+			break;
+		case LEGACY_FNSAVE:
+			if (restore)
+				asm volatile("frstor %0" : : "m"(fnsave_area));
+			else
+				asm volatile("fnsave %0" : "=m"(fnsave_area));
+			break;
+		case LEGACY_SPILL_XMM:
+			if (restore)
+				fill_xmm(&sa);
+			else
+				spill_xmm(&sa);
+			break;
+		case LEGACY_SPILL_YMM:
+			if (restore)
+				fill_ymm(&sa);
+			else
+				spill_ymm(&sa);
+			break;
+		}
+		save_res[i] = stop_timing(start);
+	}
+
+	output_results(legacy_titles[method][restore], dt->name);
+}
+
+enum {
+	XSAVE,
+	XRSTOR,
+	XRSTOR_ALT,
+	INIT_XSAVE,
+	FPUSTATE,
+	PTRACE,
+	INFER,
+	LEGACY,
+	SWAP,
+	LIBC,
+	WRITTEN,
+	SYSCALL,
+	COLD,
+	ENERGY,
+	REPLAY,
+};
+
+static const char * const main_tests[] = {
+	[XSAVE] = "XSAVE",
+	[XRSTOR] = "XRSTOR",
+	[XRSTOR_ALT] = "XRSTOR_ALT",
+	[INIT_XSAVE] = "INIT_XSAVE",
+	[FPUSTATE] = "FPUSTATE",
+	[PTRACE] = "PTRACE",
+	[INFER] = "INFER",
+	[LEGACY] = "LEGACY",
+	[SWAP] = "SWAP",
+	[LIBC] = "LIBC",
+	[WRITTEN] = "WRITTEN",
+	[SYSCALL] = "SYSCALL",
+	[COLD] = "COLD",
+	[ENERGY] = "ENERGY",
+	[REPLAY] = "REPLAY",
+};
+
+/* The tests run_cell() can do, which are the only ones a soak, sweep, or
+ * campaign can run. */
+static const int cell_tests[] = {
+	XSAVE, XRSTOR, XRSTOR_ALT, INIT_XSAVE, FPUSTATE, PTRACE, LEGACY, SWAP,
+};
+
+static bool is_cell_test(int test_id)
+{
+	for (int i = 0; i < sizeof(cell_tests) / sizeof(int); i++)
+		if (cell_tests[i] == test_id)
+			return true;
+	return false;
+}
+
+/* Runs every variant of test_id for one dirty test. */
+static void run_cell(int test_id, struct dirty_test *dt)
+{
+	maybe_recalibrate();
+	switch (test_id) {
+	case XSAVE:
+		test_xsave(dt, false, false);
+		test_xsave(dt, true,  false);
+		test_xsave(dt, false, true);
+		test_xsave(dt, true,  true);
+		break;
+	case XRSTOR:
+		test_xrstor(dt, XRSTOR_CMD_NOOP);
+		test_xrstor(dt, XRSTOR_CMD_CLEAN);
+		test_xrstor(dt, XRSTOR_CMD_DIRTY);
+		break;
+	case XRSTOR_ALT:
+		test_xrstor_alt(dt, false, false);
+		test_xrstor_alt(dt, true,  false);
+		test_xrstor_alt(dt, false, true);
+		test_xrstor_alt(dt, true,  true);
+		break;
+	case INIT_XSAVE:
+		test_init_xsave(dt, false);
+		test_init_xsave(dt, true);
+		break;
+	case FPUSTATE:
+		test_fpustate(dt, false);
+		test_fpustate(dt, true);
+		break;
+	case PTRACE:
+		test_ptrace(dt, false);
+		test_ptrace(dt, true);
+		break;
+	case LEGACY:
+		/* The XSAVE versions first, for comparison. */
+		test_init_xsave(dt, false);
+		test_init_xsave(dt, true);
+		test_xrstor(dt, XRSTOR_CMD_CLEAN);
+		for (int m = LEGACY_FXSAVE; m <= LEGACY_SPILL_YMM; m++) {
+			test_legacy(dt, m, false);
+			test_legacy(dt, m, true);
+		}
+		break;
+	case SWAP:
+		/* dt is the incoming context. */
+		for (int j = 0; j < NR_DIRTY_TESTS; j++)
+			test_swap(&dirty_tests[j], dt);
+		break;
+	}
+}
+
+static void run_test(int test_id)
+{
+	for (int i = 0; i < sizeof(dirty_tests) / sizeof(dirty_tests[0]); i++)
+		run_cell(test_id, &dirty_tests[i]);
+}
+
+/* Dirty tests are named with leading dots for alignment; match without them. */
+static struct dirty_test *get_dirty_test(const char *name)
+{
+	const char *dt_name;
+
+	for (int i = 0; i < sizeof(dirty_tests) / sizeof(dirty_tests[0]); i++) {
+		dt_name = dirty_tests[i].name;
+		while (*dt_name == '.')
+			dt_name++;
+		if (!strcmp(dt_name, name))
+			return &dirty_tests[i];
+	}
+	return NULL;
+}
+
+/* One batch of a soak run: the summary of each result of a run_cell().  SWAP
+ * has one per dirty test, so this grows as needed. */
+static struct soak_result {
+	const char *title;
+	const char *name;
+	int64_t med, min, max;
+	int64_t overhead, overhead_p5, overhead_p95;	/* what we subtracted */
+} *soak_results;
+static int nr_soak_results, max_soak_results;
+
+static void soak_hook(const char *title, const char *name)
+{
+	struct soak_result *sr;
+
+	if (nr_soak_results == max_soak_results) {
+		max_soak_results = max_soak_results ? 2 * max_soak_results : 16;
+		soak_results = realloc(soak_results,
+		                       max_soak_results * sizeof(struct soak_result));
+		if (!soak_results) {
+			perror("realloc");
+			exit(-1);
+		}
+	}
+	sr = &soak_results[nr_soak_results++];
+	/* The test's title is on its stack, so keep our own copy. */
+	sr->title = strdup(title);
+	sr->name = name;
+	sr->med = median(save_res, nr_iters);
+	sr->min = save_res[0];
+	sr->max = save_res[nr_iters - 1];
+	sr->overhead = rd_overhead;
+	sr->overhead_p5 = rd_overhead_p5;
+	sr->overhead_p95 = rd_overhead_p95;
+}
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Repeats one cell every period_ms for soak_secs, writing a time series with
+ * one line per result per batch instead of the raw samples.  Along with each
+ * batch, we record when it ran, the ratio of core cycles to TSC ticks during
+ * the batch (i.e. the effective frequency versus nominal), and the package
+ * temperature, so the costs can be correlated with throttling, turbo, and
+ * whatever else the machine was up to. */
+static void run_soak(int test_id, struct dirty_test *dt, int soak_secs,
+                     int period_ms)
+{
+	uint64_t t0, now, next;
+	uint64_t tsc_start, cyc_start, tsc_delta, cyc_delta;
+	struct timespec ts;
+	int temp;
+
+	fprintf(outfile, "# columns: secs tsc cyc_per_tsc temp_c test dirty median min max overhead ovh_p5 ovh_p95\n");
+	result_hook = soak_hook;
+	t0 = mono_ns();
+	next = t0;
+	do {
+		nr_soak_results = 0;
+		now = mono_ns();
+		tsc_start = __rdtsc();
+		cyc_start = cycles();
+		run_cell(test_id, dt);
+		cyc_delta = cycles() - cyc_start;
+		tsc_delta = __rdtsc() - tsc_start;
+		temp = read_pkg_temp();
+		for (int i = 0; i < nr_soak_results; i++) {
+			fprintf(outfile, "%.3f %llu %.4f ", (now - t0) / 1e9, tsc_start,
+			        (double)cyc_delta / tsc_delta);
+			if (temp < 0)
+				fprintf(outfile, "NA ");
+			else
+				fprintf(outfile, "%.1f ", temp / 1000.0);
+			fprintf(outfile, "%s %s %lld %lld %lld %lld %lld %lld\n",
+			        soak_results[i].title, soak_results[i].name,
+			        soak_results[i].med, soak_results[i].min,
+			        soak_results[i].max, soak_results[i].overhead,
+			        soak_results[i].overhead_p5, soak_results[i].overhead_p95);
+			free((char *)soak_results[i].title);
+		}
+		fflush(outfile);
+
+		next += period_ms * 1000000ULL;
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	} while (mono_ns() - t0 < soak_secs * 1000000000ULL);
+	result_hook = NULL;
+}
+
+/* Masks to sweep, either given with --masks or every subset of the -m mask. */
+#define MAX_SWEEP_MASKS 1024
+static unsigned long long sweep_masks[MAX_SWEEP_MASKS];
+static int nr_sweep_masks;
+
+static void parse_masks(char *list)
+{
+	char *tok;
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (nr_sweep_masks == MAX_SWEEP_MASKS) {
+			fprintf(stderr, "Too many masks, max is %d\n", MAX_SWEEP_MASKS);
+			exit(1);
+		}
+		sweep_masks[nr_sweep_masks++] = strtoull(tok, 0, 0);
+	}
+}
+
+static void set_sweep_subsets(unsigned long long full)
+{
+	unsigned long long sub = 0;
+
+	/* Walks the subsets of full in increasing order, starting with 0. */
+	do {
+		if (nr_sweep_masks == MAX_SWEEP_MASKS) {
+			fprintf(stderr, "Too many subsets of %#llx, try --masks\n", full);
+			exit(1);
+		}
+		sweep_masks[nr_sweep_masks++] = sub;
+		sub = (sub - full) & full;
+	} while (sub);
+}
+
+/* Runs test_id for every mask in sweep_masks, then reports how much we save by
+ * masking out components versus letting the init optimization skip them. */
+static void run_sweep(int test_id, unsigned long long full)
+{
+	int64_t masked[MAX_SWEEP_MASKS], initopt[MAX_SWEEP_MASKS];
+	int64_t base_masked, base_initopt;
+
+	for (int i = 0; i < nr_sweep_masks; i++) {
+		mask = sweep_masks[i];
+		snprintf(cell_prefix, sizeof(cell_prefix), "M0x%llx_", mask);
+		run_test(test_id);
+	}
+	mask = full;
+	cell_prefix[0] = '\0';
+
+	test_mask_cost(full, full, false, &base_masked);
+	test_mask_cost(full, full, true, &base_initopt);
+	for (int i = 0; i < nr_sweep_masks; i++) {
+		test_mask_cost(sweep_masks[i], full, false, &masked[i]);
+		test_mask_cost(sweep_masks[i], full, true, &initopt[i]);
+	}
+
+	report("Savemask sweep, median cycles (reduction vs 0x%03llx):\n", full);
+	report("%8s %20s %20s\n", "mask", "masked XSAVEOPT", "init-opt XSAVEOPT");
+	for (int i = 0; i < nr_sweep_masks; i++)
+		report("   0x%03llx %8lld (%+8lld) %8lld (%+8lld)\n",
+		       sweep_masks[i], masked[i], base_masked - masked[i], initopt[i],
+		       base_initopt - initopt[i]);
+}
+
+/* Samples kept around for the inference report, keyed by title and dirty test
+ * name. */
+#define MAX_INFER_SETS 256
+static struct sample_set {
+	char title[32];
+	const char *name;
+	int64_t *vals;
+} infer_sets[MAX_INFER_SETS];
+static int nr_infer_sets;
+
+static void infer_hook(const char *title, const char *name)
+{
+	struct sample_set *ss;
+
+	write_results(title, name, true);
+	if (nr_infer_sets == MAX_INFER_SETS)
+		return;
+	ss = &infer_sets[nr_infer_sets++];
+	snprintf(ss->title, sizeof(ss->title), "%s%s", cell_prefix, title);
+	ss->name = name;
+	ss->vals = malloc(nr_iters * sizeof(int64_t));
+	memcpy(ss->vals, save_res, nr_iters * sizeof(int64_t));
+}
+
+static int64_t *get_samples(const char *title, const char *name)
+{
+	struct dirty_test *dt = get_dirty_test(name);
+
+	for (int i = 0; i < nr_infer_sets; i++)
+		if (!strcmp(infer_sets[i].title, title) && infer_sets[i].name == dt->name)
+			return infer_sets[i].vals;
+	fprintf(stderr, "Inference is missing the %s %s samples!\n", title, name);
+	exit(-1);
+}
+
+/* We call something a difference if it's unlikely to be noise and at least a
+ * couple cycles, which is about what rdpmc can resolve. */
+#define INFER_ALPHA 0.001
+#define INFER_MIN_DELTA 2.0
+
+struct comparison {
+	double delta;		/* median(b) - median(a) */
+	double p;			/* two-sided p-value that a and b are the same */
+};
+
+struct ranked {
+	int64_t val;
+	bool from_b;
+};
+
+static int cmp_ranked(const void *a, const void *b)
+{
+	return fpustate_cmp_s64(&((const struct ranked *)a)->val,
+	               &((const struct ranked *)b)->val);
+}
+
+/* Mann-Whitney U test of a vs b, using the normal approximation with a
+ * correction for ties.  Cycle counts tie a lot.  We don't assume anything about
+ * the distributions, which are usually lumpy and have long tails. */
+static void compare_samples(int64_t *a, int64_t *b, int n,
+                            struct comparison *c)
+{
+	struct ranked *all = malloc(2 * n * sizeof(struct ranked));
+	double rank_b = 0, ties = 0, u, sigma, z;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		all[i] = (struct ranked){a[i], false};
+		all[n + i] = (struct ranked){b[i], true};
+	}
+	qsort(all, 2 * n, sizeof(struct ranked), cmp_ranked);
+	for (i = 0; i < 2 * n; i = j) {
+		for (j = i; j < 2 * n && all[j].val == all[i].val; j++)
+			;
+		/* Everyone in [i, j) gets the average of ranks i+1 .. j. */
+		for (int k = i; k < j; k++)
+			if (all[k].from_b)
+				rank_b += (i + 1 + j) / 2.0;
+		ties += pow(j - i, 3) - (j - i);
+	}
+	free(all);
+
+	u = rank_b - n * (n + 1) / 2.0;
+	sigma = sqrt(n * n / 12.0 * (2 * n + 1 - ties / (2.0 * n * (2 * n - 1))));
+	z = sigma > 0 ? (u - n * n / 2.0) / sigma : 0;
+	c->p = erfc(fabs(z) / sqrt(2));
+	c->delta = (double)median(b, n) - (double)median(a, n);
+}
+
+static bool compare(const char *title_a, const char *name_a,
+                    const char *title_b, const char *name_b,
+                    struct comparison *c)
+{
+	compare_samples(get_samples(title_a, name_a),
+	                get_samples(title_b, name_b), nr_iters, c);
+	return c->p < INFER_ALPHA && fabs(c->delta) >= INFER_MIN_DELTA;
+}
+
+static void report_cmp(const char *what, bool yes, struct comparison *c)
+{
+	report("  %-40s %-3s %+7.1f cycles, confidence %.4f\n", what,
+	       yes ? "yes" : "no", c->delta, 1 - c->p);
+}
+
+/* For each component, the dirty test that uses everything 'base' does, plus
+ * that component. */
+static const struct {
+	const char *comp;
+	const char *base;
+	const char *with;
+} infer_comps[] = {
+	{"x87", "noop", "x87"},
+	{"SSE", "noop", "xmm"},
+	{"AVX", "xmm", "hi_ymm"},
+};
+
+#define NR_INFER_COMPS (sizeof(infer_comps) / sizeof(infer_comps[0]))
+
+/* Runs the cells that answer the questions in the comments of test_xsave(),
+ * test_xrstor(), test_xrstor_alt(), and test_init_xsave(), and answers them,
+ * instead of us squinting at boxplots.  The raw samples still go to the
+ * outfile, and the report goes at its end. */
+static void run_infer(void)
+{
+	struct comparison c;
+	bool yes;
+	char what[64];
+	static const char * const rstor_titles[] = {
+		"NOOP__XRSTOR", "CLEAN_XRSTOR", "DIRTY_XRSTOR"
+	};
+
+	result_hook = infer_hook;
+	run_test(INIT_XSAVE);
+	run_test(XSAVE);
+	run_test(XRSTOR);
+	/* XRSTOR_ALT reuses some of XRSTOR's titles. */
+	strcpy(cell_prefix, "ALT_");
+	run_test(XRSTOR_ALT);
+	cell_prefix[0] = '\0';
+	result_hook = NULL;
+
+	report("Inferred optimizations, %d samples per cell, alpha %g:\n",
+	       nr_iters, INFER_ALPHA);
+
+	report("Init optimization: components in their init state aren't saved\n");
+	for (int i = 0; i < NR_INFER_COMPS; i++) {
+		for (int opt = 0; opt < 2; opt++) {
+			snprintf(what, sizeof(what), "%s, %s", infer_comps[i].comp,
+			         opt ? "XSAVEOPT" : "XSAVE");
+			yes = compare(opt ? "INIT_XSAVEOPT" : "INIT_XSAVE",
+			              infer_comps[i].base,
+			              opt ? "INIT_XSAVEOPT" : "INIT_XSAVE",
+			              infer_comps[i].with, &c);
+			report_cmp(what, yes && c.delta > 0, &c);
+		}
+	}
+
+	report("Modified optimization: in-use components that weren't modified since the XRSTOR aren't saved\n");
+	yes = compare("XSAVE", "noop", "XSAVEOPT", "noop", &c);
+	report_cmp("nothing modified, XSAVEOPT vs XSAVE", yes && c.delta < 0, &c);
+	for (int i = 0; i < NR_INFER_COMPS; i++) {
+		snprintf(what, sizeof(what), "%s modified, XSAVEOPT",
+		         infer_comps[i].comp);
+		yes = compare("XSAVEOPT", infer_comps[i].base, "XSAVEOPT",
+		              infer_comps[i].with, &c);
+		report_cmp(what, yes && c.delta > 0, &c);
+	}
+
+	report("XRSTOR depends on the current FPU state (NOOP, CLEAN, or DIRTY)\n");
+	for (int i = 0; i < 2; i++) {
+		const char *image = i ? "all_data_reg" : "noop";
+
+		for (int a = 0; a < 3; a++) {
+			for (int b = a + 1; b < 3; b++) {
+				snprintf(what, sizeof(what), "%s image, %.5s vs %.5s", image,
+				         rstor_titles[a], rstor_titles[b]);
+				yes = compare(rstor_titles[a], image, rstor_titles[b], image,
+				              &c);
+				report_cmp(what, yes, &c);
+			}
+		}
+	}
+
+	report("XRSTOR skips reloading what wasn't modified since the last save\n");
+	for (int clean = 0; clean < 2; clean++) {
+		for (int i = 0; i < NR_INFER_COMPS; i++) {
+			snprintf(what, sizeof(what), "%s modified, %s image",
+			         infer_comps[i].comp, clean ? "clean" : "dirty");
+			yes = compare(clean ? "ALT_CLEAN_XRSTOR" : "ALT_DIRTY_XRSTOR",
+			              "noop",
+			              clean ? "ALT_CLEAN_XRSTOR" : "ALT_DIRTY_XRSTOR",
+			              infer_comps[i].with, &c);
+			report_cmp(what, yes && c.delta > 0, &c);
+		}
+	}
+}
+
+/* Prints the median swap costs as a matrix, outgoing down, incoming across. */
+static void run_swap(void)
+{
+	run_test(SWAP);
+
+	report("Median XSAVEOPT+XRSTOR cycles, outgoing (rows) x incoming (columns):\n");
+	report("%15s", "");
+	for (int j = 0; j < NR_DIRTY_TESTS; j++)
+		report(" %5d", j);
+	report("\n");
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		report("%15s", dirty_tests[i].name);
+		for (int j = 0; j < NR_DIRTY_TESTS; j++)
+			report(" %5lld", swap_matrix[i][j]);
+		report("  (%d)\n", i);
+	}
+}
+
+enum {
+	EN_XSAVE,
+	EN_XSAVEOPT,
+	EN_XRSTOR,
+	EN_NR,
+};
+
+static const char * const energy_titles[] = {
+	[EN_XSAVE] = "XSAVE",
+	[EN_XSAVEOPT] = "XSAVEOPT",
+	[EN_XRSTOR] = "XRSTOR",
+};
+
+static int energy_batch = 1 << 18;
+
+struct energy_sample {
+	uint64_t cyc;
+	uint64_t ns;
+	uint64_t pkg_uj, core_uj;
+};
+
+/* Runs energy_batch back-to-back ops with dt's dirtiness.  RAPL only updates
+ * every millisecond or so and counts in ~60uJ steps, so we can't time single
+ * ops: a batch needs to run for at least several milliseconds.
+ *
+ * The saves go to alt_as each time, with nothing restored from it, so XSAVEOPT
+ * gets the init optimization but not the modified one.  The restores alternate
+ * between two images so that each one has to load something. */
+static void energy_run(struct dirty_test *dt, int op, int core, bool rapl,
+                       struct energy_sample *es)
+{
+	uint64_t cyc, ns, pkg = 0, core_e = 0;
+
+	reset_fp();
+	dt->dirty();
+	if (op == EN_XRSTOR) {
+		__builtin_ia32_xsave64(&as, mask);
+		__builtin_ia32_xsave64(&alt_as, mask);
+	}
+	if (rapl)
+		read_energy(core, &pkg, &core_e);
+	ns = mono_ns();
+	cyc = cycles();
+	switch (op) {
+	case EN_XSAVE:
+		for (int i = 0; i < energy_batch; i++)
+			__builtin_ia32_xsave64(&alt_as, mask);
+		break;
+	case EN_XSAVEOPT:
+		for (int i = 0; i < energy_batch; i++)
+			__builtin_ia32_xsaveopt64(&alt_as, mask);
+		break;
+	case EN_XRSTOR:
+		for (int i = 0; i + 1 < energy_batch; i += 2) {
+			__builtin_ia32_xrstor64(&as, mask);
+			__builtin_ia32_xrstor64(&alt_as, mask);
+		}
+		if (energy_batch & 1)
+			__builtin_ia32_xrstor64(&as, mask);
+		break;
+	}
+	es->cyc = cycles() - cyc;
+	es->ns = mono_ns() - ns;
+	if (rapl) {
+		read_energy(core, &es->pkg_uj, &es->core_uj);
+		es->pkg_uj -= pkg;
+		if (es->core_uj != -1)
+			es->core_uj -= core_e;
+	}
+}
+
+/* Measures the power of a busy core that isn't touching the FPU, in uJ per
+ * second (uW), by spinning on our core for as long as nr_iters batches take
+ * (and at least a second, for RAPL's sake).  Sleeping would be cheaper, but
+ * the package would drop into deeper C-states than it can while we run
+ * batches, and we'd charge the difference to the instructions. */
+static void energy_baseline(int core, int op, double *pkg_uw, double *core_uw)
+{
+	struct energy_sample es;
+	uint64_t pkg0, core0, pkg1, core1, ns, len;
+	volatile uint64_t spin = 0;
+
+	energy_run(&dirty_tests[0], op, core, false, &es);
+	len = MAX(es.ns * nr_iters, 1000000000ULL);
+	read_energy(core, &pkg0, &core0);
+	ns = mono_ns();
+	while (mono_ns() - ns < len)
+		for (int i = 0; i < 1000; i++)
+			spin++;
+	read_energy(core, &pkg1, &core1);
+	ns = mono_ns() - ns;
+	*pkg_uw = (pkg1 - pkg0) * 1e9 / ns;
+	*core_uw = core0 == -1 ? 0 : (core1 - core0) * 1e9 / ns;
+}
+
+/* Picojoules per op of a batch, after taking out what the package would have
+ * burned spinning for as long as the batch ran. */
+static int64_t energy_pj(uint64_t uj, uint64_t ns, double base_uw)
+{
+	return llround((uj - base_uw * ns / 1e9) * 1e6 / energy_batch);
+}
+
+/* Energy per XSAVE, XSAVEOPT, and XRSTOR, next to cycles, from nr_iters
+ * batches of energy_batch ops for each dirty test.  The energy is from RAPL:
+ * the package, and the cores if the CPU has a separate counter.  Without RAPL,
+ * we only report cycles. */
+static void run_energy(int core)
+{
+	struct energy_sample *es = malloc(nr_iters * sizeof(struct energy_sample));
+	int64_t cyc_med[NR_DIRTY_TESTS][EN_NR];
+	int64_t pkg_med[NR_DIRTY_TESTS][EN_NR];
+	int64_t core_med[NR_DIRTY_TESTS][EN_NR];
+	uint64_t pkg, core_e;
+	double base_pkg_uw = 0, base_core_uw = 0;
+	bool rapl, have_core;
+	char title[32];
+
+	rapl = !read_energy(core, &pkg, &core_e);
+	have_core = rapl && core_e != -1;
+	if (rapl) {
+		energy_baseline(core, EN_XSAVE, &base_pkg_uw, &base_core_uw);
+		if (have_core)
+			report("energy: spinning package %.3f W, cores %.3f W, %d ops per batch\n",
+			       base_pkg_uw / 1e6, base_core_uw / 1e6, energy_batch);
+		else
+			report("energy: spinning package %.3f W, %d ops per batch\n",
+			       base_pkg_uw / 1e6, energy_batch);
+	} else {
+		report("energy: no RAPL, reporting cycles only\n");
+	}
+
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		maybe_recalibrate();
+		for (int op = 0; op < EN_NR; op++) {
+			for (int j = 0; j < nr_iters; j++)
+				energy_run(&dirty_tests[i], op, core, rapl, &es[j]);
+
+			for (int j = 0; j < nr_iters; j++)
+				save_res[j] = (es[j].cyc + energy_batch / 2) / energy_batch;
+			snprintf(title, sizeof(title), "CYC_%s", energy_titles[op]);
+			output_counts(title, dirty_tests[i].name);
+			cyc_med[i][op] = median(save_res, nr_iters);
+			if (!rapl)
+				continue;
+
+			for (int j = 0; j < nr_iters; j++)
+				save_res[j] = energy_pj(es[j].pkg_uj, es[j].ns, base_pkg_uw);
+			snprintf(title, sizeof(title), "PJ_PKG_%s", energy_titles[op]);
+			output_counts(title, dirty_tests[i].name);
+			pkg_med[i][op] = median(save_res, nr_iters);
+			if (!have_core)
+				continue;
+
+			for (int j = 0; j < nr_iters; j++)
+				save_res[j] = energy_pj(es[j].core_uj, es[j].ns, base_core_uw);
+			snprintf(title, sizeof(title), "PJ_CORE_%s", energy_titles[op]);
+			output_counts(title, dirty_tests[i].name);
+			core_med[i][op] = median(save_res, nr_iters);
+		}
+	}
+	free(es);
+
+	report("Median cycles%s per op:\n",
+	       !rapl ? "" : have_core ? ", package nJ, core nJ" : ", package nJ");
+	report("%15s", "");
+	for (int op = 0; op < EN_NR; op++)
+		report(" %*s", 8 + 10 * rapl + 10 * have_core, energy_titles[op]);
+	report("\n");
+	for (int i = 0; i < NR_DIRTY_TESTS; i++) {
+		report("%15s", dirty_tests[i].name);
+		for (int op = 0; op < EN_NR; op++) {
+			report(" %8lld", cyc_med[i][op]);
+			if (rapl)
+				report(" %9.2f", pkg_med[i][op] / 1000.0);
+			if (have_core)
+				report(" %9.2f", core_med[i][op] / 1000.0);
+		}
+		report("\n");
+	}
+}
+
+/* A recorded workload for REPLAY: either a trace of switches, or per-thread
+ * histograms of states (from fpusampler) to draw switches from. */
+static char *replay_file;
+static int replay_switches = 100000;
+static int replay_pool = 16;
+
+/* in_area is the save area of the incoming thread, which the next switch
+ * saves into. */
+struct replay_switch {
+	uint64_t out_bv, in_bv;
+	int in_area;
+};
+
+static struct replay_switch *replay_trace;
+static int nr_replay_trace;
+static int nr_replay_areas, replay_first_area;
+
+struct replay_thread {
+	long long tid;
+	uint64_t total;
+	uint64_t hist[X86_MAX_XCR0 + 1];
+};
+
+static struct replay_thread *replay_threads;
+static int nr_replay_threads;
+
+static struct replay_thread *replay_get_thread(long long tid)
+{
+	struct replay_thread *rt;
+
+	for (int i = 0; i < nr_replay_threads; i++)
+		if (replay_threads[i].tid == tid)
+			return &replay_threads[i];
+	replay_threads = realloc(replay_threads, (nr_replay_threads + 1) *
+	                         sizeof(struct replay_thread));
+	rt = &replay_threads[nr_replay_threads++];
+	memset(rt, 0, sizeof(struct replay_thread));
+	rt->tid = tid;
+	return rt;
+}
+
+/* Reads replay_file, whose lines are either "out_bv in_bv", one per switch, or
+ * fpusampler's "tid xstate_bv count".  We only keep the components in mask
+ * that fit in an ancillary_state (and a histogram). */
+static void replay_read(void)
+{
+	struct replay_thread *rt;
+	FILE *f = fopen(replay_file, "r");
+	char line[256];
+	long long a, b, c;
+	int n, cols = 0, max_trace = 0;
+
+	if (!f) {
+		perror("opening replay file");
+		exit(-1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		n = sscanf(line, "%lli %lli %lli", &a, &b, &c);
+		if (n <= 0)
+			continue;
+		if (n == 1 || (cols && n != cols)) {
+			fprintf(stderr, "Bad replay line: %s", line);
+			exit(1);
+		}
+		cols = n;
+		if (n == 3) {
+			rt = replay_get_thread(a);
+			rt->hist[b & mask & X86_MAX_XCR0] += c;
+			rt->total += c;
+			continue;
+		}
+		if (nr_replay_trace == max_trace) {
+			max_trace = max_trace ? 2 * max_trace : 1024;
+			replay_trace = realloc(replay_trace,
+			                       max_trace * sizeof(struct replay_switch));
+		}
+		replay_trace[nr_replay_trace].out_bv = a & mask & X86_MAX_XCR0;
+		replay_trace[nr_replay_trace].in_bv = b & mask & X86_MAX_XCR0;
+		nr_replay_trace++;
+	}
+	fclose(f);
+	if (!cols) {
+		fprintf(stderr, "Replay file %s is empty\n", replay_file);
+		exit(1);
+	}
+	/* A trace doesn't say whose switch it was, so it goes round-robin. */
+	nr_replay_areas = replay_pool;
+	for (int i = 0; i < nr_replay_trace; i++)
+		replay_trace[i].in_area = (i + 1) % replay_pool;
+}
+
+static uint64_t replay_rand(uint64_t *x)
+{
+	/* xorshift64, so runs are repeatable */
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static uint64_t replay_draw(uint64_t *x, struct replay_thread *rt)
+{
+	uint64_t r = replay_rand(x) % rt->total;
+	int bv;
+
+	for (bv = 0; r >= rt->hist[bv]; bv++)
+		r -= rt->hist[bv];
+	return bv;
+}
+
+/* Draws the next thread to run, by its share of the samples, other than skip
+ * if anyone else ever ran. */
+static int replay_draw_thread(uint64_t *x, uint64_t total, int skip)
+{
+	uint64_t r;
+	int t;
+
+	if (skip >= 0 && total > replay_threads[skip].total)
+		total -= replay_threads[skip].total;
+	else
+		skip = -1;
+	r = replay_rand(x) % total;
+	for (t = 0; t == skip || r >= replay_threads[t].total; t++)
+		if (t != skip)
+			r -= replay_threads[t].total;
+	return t;
+}
+
+/* Without a trace, we make one up from the histograms.  The sampler doesn't
+ * record the order threads ran in, or when a thread's state changed, so the
+ * switches are only as real as the distributions: threads run as often as they
+ * were sampled, each thread has its own save area, and it switches out in a
+ * state drawn from its own histogram.  It switches back in with whatever it
+ * switched out with last time. */
+static void replay_make_trace(void)
+{
+	uint64_t total = 0, x = 88172645463325252ULL;
+	uint64_t *last_bv;
+	int cur, next;
+
+	for (int t = 0; t < nr_replay_threads; t++)
+		total += replay_threads[t].total;
+	if (!total) {
+		fprintf(stderr, "Replay histogram has no samples\n");
+		exit(1);
+	}
+	last_bv = malloc(nr_replay_threads * sizeof(uint64_t));
+	for (int t = 0; t < nr_replay_threads; t++)
+		last_bv[t] = replay_threads[t].total ?
+		             replay_draw(&x, &replay_threads[t]) : 0;
+	nr_replay_trace = replay_switches;
+	replay_trace = malloc(nr_replay_trace * sizeof(struct replay_switch));
+	nr_replay_areas = nr_replay_threads;
+	cur = replay_first_area = replay_draw_thread(&x, total, -1);
+	for (int i = 0; i < nr_replay_trace; i++) {
+		last_bv[cur] = replay_draw(&x, &replay_threads[cur]);
+		next = replay_draw_thread(&x, total, cur);
+		replay_trace[i].out_bv = last_bv[cur];
+		replay_trace[i].in_bv = last_bv[next];
+		replay_trace[i].in_area = next;
+		cur = next;
+	}
+	free(last_bv);
+}
+
+/* Replays the switches through the save areas like a scheduler would: the
+ * outgoing thread ran and dirtied everything in out_bv, which we put on the
+ * FPU by restoring alt_as, and we time the XSAVEOPT into its area and the
+ * XRSTOR of the incoming thread's area, which has in_bv in use.
+ *
+ * We assume a thread modifies everything it has in use while it runs, so the
+ * modified optimization never helps, and we can only make states out of
+ * XRSTOR from a template.  That's pessimistic for threads that have, say, AVX
+ * in use but only touch SSE. */
+static void replay_run(int64_t *res, bool timed)
+{
+	struct ancillary_state *pool;
+	uint64_t start;
+	int cur = replay_first_area, next;
+
+	if (posix_memalign((void **)&pool, 64,
+	                   nr_replay_areas * sizeof(struct ancillary_state))) {
+		perror("posix_memalign");
+		exit(-1);
+	}
+	for (int i = 0; i < nr_replay_areas; i++)
+		memcpy(&pool[i], &dirty_as, sizeof(struct ancillary_state));
+	memcpy(&alt_as, &dirty_as, sizeof(struct ancillary_state));
+
+	reset_fp();
+	__builtin_ia32_xrstor64(&pool[cur], mask);
+	for (int i = 0; i < nr_replay_trace; i++) {
+		next = replay_trace[i].in_area;
+		alt_as.xstate_bv = replay_trace[i].out_bv;
+		__builtin_ia32_xrstor64(&alt_as, mask);
+		pool[next].xstate_bv = replay_trace[i].in_bv;
+		start = start_timing();
+		__builtin_ia32_xsaveopt64(&pool[cur], mask);
+		__builtin_ia32_xrstor64(&pool[next], mask);
+		if (timed)
+			res[i] = stop_timing(start);
+		cur = next;
+	}
+	free(pool);
+}
+
+static int64_t percentile(int64_t *sorted, int n, double p)
+{
+	return sorted[MIN(n - 1, (int)(p * n))];
+}
+
+/* Replays a recorded workload's switches and reports the FPU cost per switch:
+ * the average, the tail, and which (outgoing, incoming) pairs it comes from.
+ * Every switch goes in the outfile, named by its pair. */
+static void run_replay(void)
+{
+	int64_t *res, *sorted;
+	double sum = 0;
+	char buf[32], name[32];
+	int n;
+	struct {
+		uint64_t out_bv, in_bv;
+		int count;
+		double sum;
+	} pairs[64];
+	int nr_pairs = 0, dropped = 0, p;
+
+	if (!replay_file) {
+		fprintf(stderr, "REPLAY needs a trace or histogram, -r file\n");
+		exit(1);
+	}
+	if (replay_pool < 1 || replay_switches < 1) {
+		fprintf(stderr, "REPLAY needs at least one save area and switch\n");
+		exit(1);
+	}
+	replay_read();
+	if (!nr_replay_trace)
+		replay_make_trace();
+	n = nr_replay_trace;
+	res = malloc(n * sizeof(int64_t));
+	sorted = malloc(n * sizeof(int64_t));
+
+	maybe_recalibrate();
+	/* Once to warm up, once for real. */
+	replay_run(res, false);
+	replay_run(res, true);
+
+	for (int i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "0x%03llx_0x%03llx",
+		         replay_trace[i].out_bv, replay_trace[i].in_bv);
+		pad_name(name, sizeof(name), buf);
+		fprintf(outfile, "%sREPLAY %s %lld\n", cell_prefix, name, res[i]);
+		sum += res[i];
+		for (p = 0; p < nr_pairs; p++)
+			if (pairs[p].out_bv == replay_trace[i].out_bv &&
+			    pairs[p].in_bv == replay_trace[i].in_bv)
+				break;
+		if (p == nr_pairs) {
+			if (nr_pairs == sizeof(pairs) / sizeof(pairs[0])) {
+				dropped++;
+				continue;
+			}
+			pairs[p].out_bv = replay_trace[i].out_bv;
+			pairs[p].in_bv = replay_trace[i].in_bv;
+			pairs[p].count = 0;
+			pairs[p].sum = 0;
+			nr_pairs++;
+		}
+		pairs[p].count++;
+		pairs[p].sum += res[i];
+	}
+	memcpy(sorted, res, n * sizeof(int64_t));
+	qsort(sorted, n, sizeof(int64_t), fpustate_cmp_s64);
+
+	if (nr_replay_threads)
+		report("Replayed %d switches drawn from %s, %d threads, cycles per switch:\n",
+		       n, replay_file, nr_replay_threads);
+	else
+		report("Replayed %d switches from %s over %d save areas, cycles per switch:\n",
+		       n, replay_file, replay_pool);
+	report("  mean %.1f, p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+	       sum / n, percentile(sorted, n, 0.5), percentile(sorted, n, 0.9),
+	       percentile(sorted, n, 0.99), percentile(sorted, n, 0.999),
+	       sorted[n - 1]);
+	report("  each less overhead %lld, which was p5 %lld to p95 %lld\n",
+	       rd_overhead, rd_overhead_p5, rd_overhead_p95);
+	report("%11s %11s %8s %10s %10s\n", "out", "in", "share", "mean", "of total");
+	for (p = 0; p < nr_pairs; p++)
+		report("      0x%03llx       0x%03llx %7.2f%% %10.1f %9.2f%%\n",
+		       pairs[p].out_bv, pairs[p].in_bv, 100.0 * pairs[p].count / n,
+		       pairs[p].sum / pairs[p].count, 100.0 * pairs[p].sum / sum);
+	if (dropped)
+		report("  (%d switches in pairs past the first %d not broken out)\n",
+		       dropped, nr_pairs);
+	free(res);
+	free(sorted);
+}
+
+/* Cores for a campaign, from --campaign, e.g. "2,3,6-9". */
+#define MAX_CAMPAIGN_CORES 256
+static int campaign_cores[MAX_CAMPAIGN_CORES];
+static int nr_campaign_cores;
+
+static void parse_cores(char *list)
+{
+	char *tok, *end;
+	int lo, hi;
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		lo = hi = strtol(tok, &end, 0);
+		if (*end == '-')
+			hi = strtol(end + 1, 0, 0);
+		for (int c = lo; c <= hi; c++) {
+			if (nr_campaign_cores == MAX_CAMPAIGN_CORES) {
+				fprintf(stderr, "Too many cores, max is %d\n",
+				        MAX_CAMPAIGN_CORES);
+				exit(1);
+			}
+			campaign_cores[nr_campaign_cores++] = c;
+		}
+	}
+}
+
+/* One run_cell(), with the mask for it.  Workers fill in the rest. */
+struct campaign_cell {
+	int test_id;
+	unsigned long long mask;
+	int dt;
+	int core;				/* -1 until someone ran it */
+	long start, end;		/* its output, in that core's file */
+	uint64_t ns;
+};
+
+/* Cores that share a physical core would perturb each other, and cores the
+ * kernel didn't set aside will get interrupted.  The first is fatal, the second
+ * is worth a warning. */
+static void campaign_check_cores(void)
+{
+	int a, b, iso;
+
+	for (int i = 0; i < nr_campaign_cores; i++) {
+		a = campaign_cores[i];
+		iso = cpu_isolation(a);
+		if (iso < 0)
+			report("campaign: core %d, can't tell if it is isolated\n", a);
+		else if (!iso)
+			report("campaign: core %d, not isolated (isolcpus or nohz_full)!\n",
+			       a);
+		else
+			report("campaign: core %d,%s%s\n", a,
+			       iso & CPU_ISOLCPUS ? " isolcpus" : "",
+			       iso & CPU_NOHZ_FULL ? " nohz_full" : "");
+		for (int j = i + 1; j < nr_campaign_cores; j++) {
+			b = campaign_cores[j];
+			if (a == b) {
+				fprintf(stderr, "Core %d is in the campaign twice\n", a);
+				exit(1);
+			}
+			if (cpu_smt_siblings(a, b) == 1) {
+				fprintf(stderr, "Cores %d and %d are SMT siblings, pick one\n",
+				        a, b);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void campaign_file(char *buf, size_t len, int core)
+{
+	snprintf(buf, len, "%s.core%d", outfile_name, core);
+}
+
+/* Runs in a child pinned to core, taking cells off the shared list until they
+ * are all taken.  Each core writes its own file, and the cell says where its
+ * results are. */
+static void campaign_worker(int core, struct campaign_cell *cells, int nr_cells,
+                            int *next_cell, bool sweep)
+{
+	char name[256];
+	struct campaign_cell *c;
+	int i;
+
+	campaign_file(name, sizeof(name), core);
+	outfile = fopen(name, "w+");
+	if (!outfile) {
+		perror("opening campaign file");
+		_exit(1);
+	}
+	if (pin_to_core(core) < 0) {
+		perror("pin_to_core");
+		_exit(1);
+	}
+	enable_speed_step(core, 0);
+	compute_rd_overhead();
+	reset_fp();
+	__builtin_ia32_xsaveopt64(&as, mask);
+	__builtin_ia32_xsave64(&as, mask);
+	__builtin_ia32_xrstor64(&as, mask);
+
+	while ((i = __atomic_fetch_add(next_cell, 1, __ATOMIC_RELAXED)) < nr_cells) {
+		c = &cells[i];
+		mask = c->mask;
+		if (sweep)
+			snprintf(cell_prefix, sizeof(cell_prefix), "M0x%llx_", mask);
+		fflush(outfile);
+		c->start = ftell(outfile);
+		c->ns = mono_ns();
+		run_cell(c->test_id, &dirty_tests[c->dt]);
+		c->ns = mono_ns() - c->ns;
+		fflush(outfile);
+		c->end = ftell(outfile);
+		c->core = core;
+	}
+	fclose(outfile);
+	_exit(0);
+}
+
+/* Runs test_id (or every test run_cell() can do, if it's -1) for every dirty
+ * test and every mask (sweep_masks, if we're sweeping) as separate cells, on
+ * one worker per campaign core.  Workers take the next cell when they finish
+ * one, so slow cells don't hold up the rest.  The merged outfile has the cells
+ * in order, each under a comment with the core it ran on. */
+static void run_campaign(int test_id, bool sweep)
+{
+	struct campaign_cell *cells;
+	int *next_cell;
+	int nr_tests = test_id < 0 ? sizeof(cell_tests) / sizeof(int) : 1;
+	int nr_masks = sweep ? nr_sweep_masks : 1;
+	int nr_cells = nr_tests * nr_masks * NR_DIRTY_TESTS;
+	size_t map_len = nr_cells * sizeof(struct campaign_cell) + sizeof(int);
+	pid_t pids[MAX_CAMPAIGN_CORES];
+	FILE *files[MAX_CAMPAIGN_CORES];
+	char name[256], buf[4096];
+	uint64_t t0, wall, cell_ns = 0;
+	struct campaign_cell *c;
+	int n = 0, status;
+	size_t len;
+
+	campaign_check_cores();
+	cells = mmap(0, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	             -1, 0);
+	if (cells == MAP_FAILED) {
+		perror("mmap");
+		exit(-1);
+	}
+	next_cell = (int *)&cells[nr_cells];
+	for (int t = 0; t < nr_tests; t++) {
+		for (int m = 0; m < nr_masks; m++) {
+			for (int d = 0; d < NR_DIRTY_TESTS; d++, n++) {
+				cells[n].test_id = test_id < 0 ? cell_tests[t] : test_id;
+				cells[n].mask = sweep ? sweep_masks[m] : mask;
+				cells[n].dt = d;
+				cells[n].core = -1;
+			}
+		}
+	}
+
+	/* Or the workers would write out our buffered output too. */
+	fflush(outfile);
+	fflush(stderr);
+	t0 = mono_ns();
+	for (int w = 0; w < nr_campaign_cores; w++) {
+		pids[w] = fork();
+		if (pids[w] < 0) {
+			perror("fork");
+			exit(-1);
+		}
+		if (!pids[w])
+			campaign_worker(campaign_cores[w], cells, nr_cells, next_cell,
+			                sweep);
+	}
+	for (int w = 0; w < nr_campaign_cores; w++) {
+		waitpid(pids[w], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			report("campaign: worker on core %d failed\n", campaign_cores[w]);
+	}
+	wall = mono_ns() - t0;
+
+	for (int w = 0; w < nr_campaign_cores; w++) {
+		campaign_file(name, sizeof(name), campaign_cores[w]);
+		files[w] = fopen(name, "r");
+	}
+	for (int i = 0; i < nr_cells; i++) {
+		c = &cells[i];
+		if (c->core < 0) {
+			report("campaign: cell %d (%s %s, mask 0x%llx) never finished\n",
+			       i, main_tests[c->test_id], dirty_tests[c->dt].name, c->mask);
+			continue;
+		}
+		fprintf(outfile, "# cell %d: %s %s, mask 0x%llx, core %d, %.3f s\n",
+		        i, main_tests[c->test_id], dirty_tests[c->dt].name, c->mask,
+		        c->core, c->ns / 1e9);
+		cell_ns += c->ns;
+		for (int w = 0; w < nr_campaign_cores; w++) {
+			if (campaign_cores[w] != c->core || !files[w])
+				continue;
+			fseek(files[w], c->start, SEEK_SET);
+			for (long left = c->end - c->start; left > 0; left -= len) {
+				len = fread(buf, 1, MIN(left, sizeof(buf)), files[w]);
+				if (!len)
+					break;
+				fwrite(buf, 1, len, outfile);
+			}
+		}
+	}
+	for (int w = 0; w < nr_campaign_cores; w++) {
+		if (!files[w])
+			continue;
+		fclose(files[w]);
+		campaign_file(name, sizeof(name), campaign_cores[w]);
+		unlink(name);
+	}
+	munmap(cells, map_len);
+
+	report("campaign: %d cells on %d cores in %.3f s, %.3f s of cells (%.2fx)\n",
+	       nr_cells, nr_campaign_cores, wall / 1e9, cell_ns / 1e9,
+	       wall ? (double)cell_ns / wall : 0);
+}
+
+static int get_test_id(const char *name)
+{
+	for (int i = 0; i < sizeof(main_tests) / sizeof(main_tests[0]); i++)
+		if (!strcmp(main_tests[i], name))
+			return i;
+	return -1;
+}
+
+/* Given an initially clean FPU on the processor, xsave should only save the
+ * parts we think dirty() touched.  We can see those in xstatebv. */
+static void assert_clobbers(void)
+{
+	struct dirty_test *dt;
+
+	for (int i = 0; i < sizeof(dirty_tests) / sizeof(dirty_tests[0]); i++) {
+		dt = &dirty_tests[i];
+		reset_fp();
+		dt->dirty();
+		__builtin_ia32_xsaveopt64(&as, 0x7);
+		if (as.xstate_bv != dt->clobbered_xstatebv) {
+			fprintf(stderr,
+					"Test %s had unexpected clobbers: xstate_bv was %p, expected %p\n",
+					dt->name, as.xstate_bv, dt->clobbered_xstatebv);
+			exit(-1);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int core = 0;
+	int opt = 0;
+	static struct option long_options[] = {
+	    {"samples", required_argument, 0, 's'},
+	    {"savemask", required_argument, 0, 'm'},
+	    {"core", required_argument, 0, 'c'},
+	    {"outfile", required_argument, 0, 'o'},
+	    {"test", required_argument, 0, 't'},
+	    {"sweep", no_argument, 0, 'S'},
+	    {"masks", required_argument, 0, 'M'},
+	    {"children", required_argument, 0, 'n'},
+	    {"soak", required_argument, 0, 'k'},
+	    {"period", required_argument, 0, 'p'},
+	    {"dirty", required_argument, 0, 'd'},
+	    {"hexdump", no_argument, 0, 'x'},
+	    {"cold-iters", required_argument, 0, 'C'},
+	    {"cold-sleep", required_argument, 0, 'L'},
+	    {"cold-core", required_argument, 0, 'O'},
+	    {"recal", required_argument, 0, 'R'},
+	    {"energy-batch", required_argument, 0, 'B'},
+	    {"replay", required_argument, 0, 'r'},
+	    {"switches", required_argument, 0, 'w'},
+	    {"pool", required_argument, 0, 'P'},
+	    {"campaign", required_argument, 0, 'K'},
+	    /* Internal, for COLD's exec case */
+	    {"cold-exec", required_argument, 0, 'E'},
+	    {0, 0, 0, 0}};
+	int long_index = 0;
+	time_t now;
+	int test_id = XSAVE;
+	bool test_given = false;
+	bool sweep = false;
+	int soak_secs = 0;
+	int period_ms = 1000;
+	struct dirty_test *cell_dt = NULL;
+	unsigned long long full_mask;
+	int cold_exec_fd = -1;
+
+	while ((opt = getopt_long(argc, argv, "c:s:m:o:t:SM:n:k:p:d:xC:L:O:R:B:r:w:P:K:", long_options,
+	                          &long_index)) != -1) {
+		switch (opt) {
+		case 'c':
+			core = strtol(optarg, 0, 0);
+			break;
+		case 'm':
+			mask = strtol(optarg, 0, 0);
+			break;
+		case 's':
+			nr_iters = atoi(optarg);
+			break;
+		case 'o':
+			outfile_name = optarg;
+			break;
+		case 'S':
+			sweep = true;
+			break;
+		case 'M':
+			sweep = true;
+			parse_masks(optarg);
+			break;
+		case 'n':
+			nr_children = atoi(optarg);
+			if (nr_children < 1) {
+				fprintf(stderr, "Need at least one child for -n\n");
+				exit(1);
+			}
+			break;
+		case 'k':
+			soak_secs = atoi(optarg);
+			break;
+		case 'x':
+			dump_written = true;
+			break;
+		case 'C':
+			cold_iters = atoi(optarg);
+			if (cold_iters < 1) {
+				fprintf(stderr, "Need at least one iteration for -C\n");
+				exit(1);
+			}
+			break;
+		case 'L':
+			cold_sleep_ms = atoi(optarg);
+			break;
+		case 'O':
+			cold_core = atoi(optarg);
+			break;
+		case 'R':
+			recal_secs = atoi(optarg);
+			break;
+		case 'B':
+			energy_batch = atoi(optarg);
+			if (energy_batch < 2) {
+				fprintf(stderr, "Need at least two ops per batch for -B\n");
+				exit(1);
+			}
+			break;
+		case 'r':
+			replay_file = optarg;
+			break;
+		case 'w':
+			replay_switches = atoi(optarg);
+			break;
+		case 'P':
+			replay_pool = atoi(optarg);
+			break;
+		case 'K':
+			parse_cores(optarg);
+			break;
+		case 'E':
+			cold_exec_fd = atoi(optarg);
+			break;
+		case 'p':
+			period_ms = atoi(optarg);
+			break;
+		case 'd':
+			cell_dt = get_dirty_test(optarg);
+			if (!cell_dt) {
+				fprintf(stderr, "Unknown dirty test '%s'.  Try:\n", optarg);
+				for (int i = 0;
+				     i < sizeof(dirty_tests) / sizeof(dirty_tests[0]);
+				     i++) {
+					fprintf(stderr, "\t%s\n", dirty_tests[i].name);
+				}
+				exit(1);
+			}
+			break;
+		case 't':
+			test_id = get_test_id(optarg);
+			test_given = true;
+			if (test_id < 0) {
+				fprintf(stderr, "Unknown test '%s'.  Try:\n", optarg);
+				for (int i = 0;
+				     i < sizeof(main_tests) / sizeof(main_tests[0]);
+				     i++) {
+					fprintf(stderr, "\t%s\n", main_tests[i]);
+				}
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr,
+			        "Usage: %s [-m savemask] [-s numsamples] [-S | -M mask,...] [-n children]\n"
+			        "          [-k soak_secs [-p period_ms] [-d dirty_test]] [-x]\n"
+			        "          [-C cold_iters] [-L cold_sleep_ms] [-O cold_core]\n"
+			        "          [-R recal_secs] [-B energy_batch]\n"
+			        "          [-r replay_file [-w switches] [-P pool_size]]\n"
+			        "          [-K campaign_cores]\n",
+			        argv[0]);
+			exit(1);
+		}
+	}
+	if (sweep) {
+		if (!is_cell_test(test_id)) {
+			fprintf(stderr,
+			        "A sweep only runs XSAVE, XRSTOR, XRSTOR_ALT, INIT_XSAVE,\n"
+			        "FPUSTATE, PTRACE, LEGACY, or SWAP\n");
+			exit(1);
+		}
+		/* Sweep whatever the processor and ancillary_state can handle. */
+		mask &= fpustate_rxcr0() & X86_MAX_XCR0;
+		if (!nr_sweep_masks)
+			set_sweep_subsets(mask);
+		for (i = 0; i < nr_sweep_masks; i++) {
+			if ((sweep_masks[i] & mask) != sweep_masks[i]) {
+				fprintf(stderr,
+				        "Sweep mask 0x%llx isn't within the savemask 0x%llx\n",
+				        sweep_masks[i], mask);
+				exit(1);
+			}
+		}
+	}
+	if ((mask & fpustate_rxcr0()) != mask || !mask_fits(mask)) {
+		fprintf(stderr,
+		        "Savemask 0x%llx isn't enabled in XCR0 (0x%llx), or doesn't fit in an ancillary_state\n",
+		        mask, fpustate_rxcr0());
+		exit(1);
+	}
+	if (soak_secs && !is_cell_test(test_id)) {
+		fprintf(stderr,
+		        "A soak only runs XSAVE, XRSTOR, XRSTOR_ALT, INIT_XSAVE,\n"
+		        "FPUSTATE, PTRACE, LEGACY, or SWAP\n");
+		exit(1);
+	}
+	if (nr_campaign_cores) {
+		if (soak_secs || (test_given && !is_cell_test(test_id))) {
+			fprintf(stderr,
+			        "A campaign only runs cells of XSAVE, XRSTOR, XRSTOR_ALT,\n"
+			        "INIT_XSAVE, FPUSTATE, PTRACE, LEGACY, or SWAP, without -k\n");
+			exit(1);
+		}
+	}
+	full_mask = mask;
+
+	if (cold_exec_fd >= 0)
+		cold_exec_child(cold_exec_fd, core,
+		                cell_dt ? cell_dt : get_dirty_test("all_data_reg"));
+	self_path = access("/proc/self/exe", X_OK) ? argv[0] : "/proc/self/exe";
+
+	if (setup(core) < 0) {
+		perror("setup");
+		exit(1);
+	}
+	enable_speed_step(core, 0);
+	save_res = malloc(nr_iters * sizeof(int64_t));
+	set_cpuinfo();
+	compute_rd_overhead();
+
+	outfile = fopen(outfile_name, "w");
+	if (!outfile) {
+		perror("opening outfile");
+		exit(-1);
+	}
+	fprintf(stderr, "Outputting to %s\n", outfile_name);
+
+	fprintf(outfile, "# title: %s %s%s%s%s Costs\n", os_name(),
+	        nr_campaign_cores && !test_given ? "ALL" : main_tests[test_id],
+	        sweep ? " Savemask Sweep" : "", soak_secs ? " Soak" : "",
+	        nr_campaign_cores ? " Campaign" : "");
+	fprintf(outfile, "# machine: %s %d, %d, %d (F, M, S)\n", vendor, family,
+	        model, stepping);
+	now = time(NULL);
+	fprintf(outfile, "# date: %s\n", ctime(&now));
+
+	if (test_id == FPUSTATE || (nr_campaign_cores && !test_given)) {
+		check_fpustate(mask);
+		fpustate_report(stderr);
+	}
+
+	setup_init_as();
+
+	/* Set up a fully-dirty ancillary state. */
+	dirty_all_data_reg();
+	__builtin_ia32_xsaveopt64(&dirty_as, 7);
+
+	assert_clobbers();
+
+	/* Prime it.  (not sure if this is necessary or not)  Not for COLD, which is
+	 * all about the unprimed costs. */
+	if (test_id != COLD) {
+		reset_fp();
+		__builtin_ia32_xsaveopt64(&as, mask);
+		__builtin_ia32_xsave64(&as, mask);
+		__builtin_ia32_xrstor64(&as, mask);
+	}
+
+	if (nr_campaign_cores)
+		run_campaign(test_given ? test_id : -1, sweep);
+	else if (soak_secs)
+		run_soak(test_id, cell_dt ? cell_dt : get_dirty_test("all_data_reg"),
+		         soak_secs, period_ms);
+	else if (sweep)
+		run_sweep(test_id, full_mask);
+	else if (test_id == INFER)
+		run_infer();
+	else if (test_id == SWAP)
+		run_swap();
+	else if (test_id == LIBC)
+		run_libc();
+	else if (test_id == WRITTEN)
+		run_written();
+	else if (test_id == SYSCALL)
+		run_syscall();
+	else if (test_id == COLD)
+		run_cold(core, cell_dt ? cell_dt : get_dirty_test("all_data_reg"));
+	else if (test_id == ENERGY)
+		run_energy(core);
+	else if (test_id == REPLAY)
+		run_replay();
+	else
+		run_test(test_id);
 
 	fclose(outfile);
 	return 0;
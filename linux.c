@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,14 @@
 #include <unistd.h>
 
 #include <sched.h>
+#include <signal.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "fputest.h"
 
 void enable_speed_step(int cpu, int on)
 {
@@ -59,13 +68,18 @@ void enable_speed_step(int cpu, int on)
 	return;
 }
 
-int setup(int core)
+int pin_to_core(int core)
 {
 	cpu_set_t my_set;
 
 	CPU_ZERO(&my_set);
 	CPU_SET(core, &my_set);
-	if (sched_setaffinity(0, sizeof(cpu_set_t), &my_set) < 0)
+	return sched_setaffinity(0, sizeof(cpu_set_t), &my_set);
+}
+
+int setup(int core)
+{
+	if (pin_to_core(core) < 0)
 		return -1;
 	/* https://stackoverflow.com/questions/22309041/rdpmc-in-user-mode-does-not-work-even-with-pce-set */
 	fprintf(stderr, "Linux: If you get a segfault, make sure rdpmc is allowed.\n"
@@ -77,3 +91,307 @@ const char *os_name(void)
 {
 	return "Linux";
 }
+
+static int read_sysfs_str(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/* Finds the package temperature sensor for the core we're on: coretemp's
+ * "Package id N" from hwmon, or else the x86_pkg_temp thermal zone. */
+static int find_pkg_temp(char *path, size_t len)
+{
+	char file[256], buf[64], want[64];
+	int pkg = 0;
+
+	snprintf(file, sizeof(file),
+	         "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+	         sched_getcpu());
+	if (!read_sysfs_str(file, buf, sizeof(buf)))
+		pkg = atoi(buf);
+	snprintf(want, sizeof(want), "Package id %d", pkg);
+	for (int i = 0; i < 64; i++) {
+		snprintf(file, sizeof(file), "/sys/class/hwmon/hwmon%d/name", i);
+		if (read_sysfs_str(file, buf, sizeof(buf)) || strcmp(buf, "coretemp"))
+			continue;
+		for (int j = 1; j < 256; j++) {
+			snprintf(file, sizeof(file),
+			         "/sys/class/hwmon/hwmon%d/temp%d_label", i, j);
+			if (read_sysfs_str(file, buf, sizeof(buf)) || strcmp(buf, want))
+				continue;
+			snprintf(path, len, "/sys/class/hwmon/hwmon%d/temp%d_input", i,
+			         j);
+			return 0;
+		}
+	}
+	for (int i = 0; i < 64; i++) {
+		snprintf(file, sizeof(file), "/sys/class/thermal/thermal_zone%d/type",
+		         i);
+		if (read_sysfs_str(file, buf, sizeof(buf)) || strcmp(buf, "x86_pkg_temp"))
+			continue;
+		snprintf(path, len, "/sys/class/thermal/thermal_zone%d/temp", i);
+		return 0;
+	}
+	return -1;
+}
+
+/* Returns the package temperature in millidegrees C, or -1. */
+int read_pkg_temp(void)
+{
+	static char path[256];
+	static bool missing;
+	char buf[64];
+
+	if (missing)
+		return -1;
+	if (!path[0] && find_pkg_temp(path, sizeof(path))) {
+		fprintf(stderr, "Linux: no package temperature sensor found\n");
+		missing = true;
+		return -1;
+	}
+	if (read_sysfs_str(path, buf, sizeof(buf)))
+		return -1;
+	return atoi(buf);
+}
+
+/* Whether core is in a cpulist like "0-3,8,10-11". */
+static bool cpu_in_list(const char *list, int core)
+{
+	char *end;
+	long lo, hi;
+
+	while (*list) {
+		lo = strtol(list, &end, 10);
+		if (end == list)
+			return false;
+		hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if (core >= lo && core <= hi)
+			return true;
+		if (*end != ',')
+			break;
+		list = end + 1;
+	}
+	return false;
+}
+
+/* Returns CPU_ISOLCPUS and CPU_NOHZ_FULL for how the kernel set core aside, or
+ * -1 if it can't tell us. */
+int cpu_isolation(int core)
+{
+	char buf[256];
+	int ret = 0;
+
+	if (read_sysfs_str("/sys/devices/system/cpu/isolated", buf, sizeof(buf)))
+		return -1;
+	if (cpu_in_list(buf, core))
+		ret |= CPU_ISOLCPUS;
+	if (!read_sysfs_str("/sys/devices/system/cpu/nohz_full", buf, sizeof(buf)) &&
+	    cpu_in_list(buf, core))
+		ret |= CPU_NOHZ_FULL;
+	return ret;
+}
+
+/* Whether cores a and b are SMT siblings: hyperthreads of one core.  Returns
+ * -1 if we can't tell. */
+int cpu_smt_siblings(int a, int b)
+{
+	char file[128], buf[256];
+
+	snprintf(file, sizeof(file),
+	         "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", a);
+	if (read_sysfs_str(file, buf, sizeof(buf)))
+		return -1;
+	return cpu_in_list(buf, b);
+}
+
+/* An energy counter, either from powercap or an MSR, extended to 64 bits. */
+struct energy_ctr {
+	char path[256];			/* powercap energy_uj, if we have it */
+	off_t msr;				/* else this MSR */
+	uint64_t range;			/* the raw counter wraps at this */
+	uint64_t last;
+	uint64_t total;
+	bool valid;
+};
+
+static struct energy_ctr pkg_ctr, core_ctr;
+static int msr_fd = -1;
+static double msr_uj_per_unit;
+
+#define MSR_RAPL_POWER_UNIT 0x606
+#define MSR_PKG_ENERGY_STATUS 0x611
+#define MSR_PP0_ENERGY_STATUS 0x639
+
+static int energy_ctr_raw(struct energy_ctr *ec, uint64_t *raw)
+{
+	char buf[64];
+	uint64_t val;
+
+	if (ec->path[0]) {
+		if (read_sysfs_str(ec->path, buf, sizeof(buf)))
+			return -1;
+		*raw = strtoull(buf, 0, 0);
+		return 0;
+	}
+	if (pread(msr_fd, &val, sizeof(val), ec->msr) != sizeof(val))
+		return -1;
+	*raw = val & 0xffffffff;
+	return 0;
+}
+
+static void energy_ctr_init(struct energy_ctr *ec)
+{
+	ec->valid = !energy_ctr_raw(ec, &ec->last);
+	ec->total = 0;
+}
+
+static uint64_t energy_ctr_read(struct energy_ctr *ec)
+{
+	uint64_t raw;
+
+	/* If the read fails, we still give the last total, in the same units. */
+	if (!energy_ctr_raw(ec, &raw)) {
+		if (raw >= ec->last)
+			ec->total += raw - ec->last;
+		else if (ec->range)
+			ec->total += ec->range - ec->last + raw;
+		ec->last = raw;
+	}
+	return ec->path[0] ? ec->total : ec->total * msr_uj_per_unit;
+}
+
+/* Looks for RAPL for the package 'core' is in: powercap's intel-rapl:N and
+ * its "core" subzone, or else the MSRs through the msr device. */
+static int energy_setup(int core)
+{
+	char file[256], buf[64];
+	uint64_t unit;
+	int pkg = 0;
+
+	snprintf(file, sizeof(file),
+	         "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", core);
+	if (!read_sysfs_str(file, buf, sizeof(buf)))
+		pkg = atoi(buf);
+	snprintf(file, sizeof(file), "/sys/class/powercap/intel-rapl:%d/name", pkg);
+	if (!read_sysfs_str(file, buf, sizeof(buf)) && !strncmp(buf, "package", 7)) {
+		snprintf(pkg_ctr.path, sizeof(pkg_ctr.path),
+		         "/sys/class/powercap/intel-rapl:%d/energy_uj", pkg);
+		snprintf(file, sizeof(file),
+		         "/sys/class/powercap/intel-rapl:%d/max_energy_range_uj", pkg);
+		if (!read_sysfs_str(file, buf, sizeof(buf)))
+			pkg_ctr.range = strtoull(buf, 0, 0);
+		for (int i = 0; i < 8; i++) {
+			snprintf(file, sizeof(file),
+			         "/sys/class/powercap/intel-rapl:%d:%d/name", pkg, i);
+			if (read_sysfs_str(file, buf, sizeof(buf)) || strcmp(buf, "core"))
+				continue;
+			snprintf(core_ctr.path, sizeof(core_ctr.path),
+			         "/sys/class/powercap/intel-rapl:%d:%d/energy_uj", pkg, i);
+			core_ctr.range = pkg_ctr.range;
+			break;
+		}
+	} else {
+		snprintf(file, sizeof(file), "/dev/cpu/%d/msr", core);
+		msr_fd = open(file, O_RDONLY);
+		if (msr_fd < 0)
+			return -1;
+		if (pread(msr_fd, &unit, sizeof(unit), MSR_RAPL_POWER_UNIT) !=
+		    sizeof(unit)) {
+			close(msr_fd);
+			msr_fd = -1;
+			return -1;
+		}
+		/* Energy status units are 1 / 2^ESU joules, ESU in bits 12:8. */
+		msr_uj_per_unit = 1e6 / (1ULL << ((unit >> 8) & 0x1f));
+		pkg_ctr.msr = MSR_PKG_ENERGY_STATUS;
+		pkg_ctr.range = 1ULL << 32;
+		core_ctr.msr = MSR_PP0_ENERGY_STATUS;
+		core_ctr.range = 1ULL << 32;
+	}
+	energy_ctr_init(&pkg_ctr);
+	energy_ctr_init(&core_ctr);
+	return pkg_ctr.valid ? 0 : -1;
+}
+
+/* Reads the package and core energy in microjoules since we started, or -1 if
+ * there's no RAPL.  core_uj is -1 if there's no core counter. */
+int read_energy(int core, uint64_t *pkg_uj, uint64_t *core_uj)
+{
+	static bool tried, missing;
+
+	if (!tried) {
+		tried = true;
+		missing = energy_setup(core) < 0;
+		if (missing)
+			fprintf(stderr, "Linux: RAPL not available (no powercap or msr)\n");
+	}
+	if (missing)
+		return -1;
+	*pkg_uj = energy_ctr_read(&pkg_ctr);
+	*core_uj = core_ctr.valid ? energy_ctr_read(&core_ctr) : -1;
+	return 0;
+}
+
+/* Forks a child that runs prep() and then stops itself under our ptrace.
+ * Returns the pid of the stopped child, or -1. */
+int xstate_child_spawn(void (*prep)(void))
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		if (ptrace(PTRACE_TRACEME, 0, 0, 0) < 0)
+			_exit(1);
+		prep();
+		/* Straight to the syscall, so libc doesn't touch the FPU. */
+		syscall(SYS_kill, syscall(SYS_getpid), SIGSTOP);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+		fprintf(stderr, "Linux: child %d didn't stop (status %#x)\n", pid,
+		        status);
+		return -1;
+	}
+	return pid;
+}
+
+void xstate_child_reap(int pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* PTRACE_{GET,SET}REGSET of NT_X86_XSTATE.  Returns the number of bytes
+ * transferred, or -1. */
+int xstate_regset_get(int pid, void *buf, size_t len)
+{
+	struct iovec iov = {buf, len};
+
+	if (ptrace(PTRACE_GETREGSET, pid, (void *)NT_X86_XSTATE, &iov) < 0)
+		return -1;
+	return iov.iov_len;
+}
+
+int xstate_regset_set(int pid, void *buf, size_t len)
+{
+	struct iovec iov = {buf, len};
+
+	if (ptrace(PTRACE_SETREGSET, pid, (void *)NT_X86_XSTATE, &iov) < 0)
+		return -1;
+	return iov.iov_len;
+}